@@ -0,0 +1,57 @@
+#include "AllocationCounter.h"
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+//One per thread, so the worker threads' allocations are not counted for the render thread
+thread_local uint64_t tHeapAllocations{ 0 };
+}
+
+uint64_t heapAllocationCount()
+{
+    return tHeapAllocations;
+}
+
+//The replaced operator new is the same as the standard one, plus the count. The other forms
+//(nothrow and the arrays) end up here, and the matching deletes free with std::free
+void* operator new(std::size_t size)
+{
+    tHeapAllocations++;
+    if (size == 0)
+        size = 1;
+    while (true)
+    {
+        if (void* memory = std::malloc(size))
+            return memory;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
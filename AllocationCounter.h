@@ -0,0 +1,14 @@
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+#include <cstdint>
+
+//Counts the heap allocations - calls to operator new - made by the calling thread since it started.
+//Take the count before and after some code to see how many allocations it made, ie. Renderer checks that
+//recording the draw calls makes none. The counter is a replaced global operator new (see AllocationCounter.cpp),
+//which on Linux also takes the place of operator new in the shared libraries, so every operator new on the thread is
+//counted - Qt's and the driver's too. That is why Renderer only reports when the count changes.
+//malloc() called directly is not counted
+uint64_t heapAllocationCount();
+
+#endif // ALLOCATIONCOUNTER_H
@@ -0,0 +1,185 @@
+#include "FractalNoise.h"
+#include "Utilities.h"
+#include <algorithm>
+#include <cmath>
+
+//SSE2 is always there on x86-64. AVX2 only when the compiler is told so (ie. -mavx2 or /arch:AVX2)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRACTALNOISE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define FRACTALNOISE_AVX2
+#include <immintrin.h>
+#endif
+
+namespace
+{
+//The operations the noise needs, on a few lanes at a time. The hash is 32 bit integer math, so all of them give the same lattice values
+#if defined(FRACTALNOISE_AVX2)
+struct Lanes
+{
+    static constexpr int kCount{ 8 };
+    using Floats = __m256;
+    using Ints = __m256i;
+    static Floats set1(float value) { return _mm256_set1_ps(value); }
+    static Ints set1(uint32_t value) { return _mm256_set1_epi32(static_cast<int32_t>(value)); }
+    static Ints laneIndex() { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
+    static Floats add(Floats a, Floats b) { return _mm256_add_ps(a, b); }
+    static Floats sub(Floats a, Floats b) { return _mm256_sub_ps(a, b); }
+    static Floats mul(Floats a, Floats b) { return _mm256_mul_ps(a, b); }
+    static Ints add(Ints a, Ints b) { return _mm256_add_epi32(a, b); }
+    static Ints mul(Ints a, Ints b) { return _mm256_mullo_epi32(a, b); }
+    static Ints bitXor(Ints a, Ints b) { return _mm256_xor_si256(a, b); }
+    template <int kBits> static Ints shiftRight(Ints a) { return _mm256_srli_epi32(a, kBits); }
+    static Ints truncate(Floats a) { return _mm256_cvttps_epi32(a); }
+    static Floats toFloat(Ints a) { return _mm256_cvtepi32_ps(a); }
+    static void store(float* p, Floats a) { _mm256_storeu_ps(p, a); }
+};
+#elif defined(FRACTALNOISE_SSE2)
+struct Lanes
+{
+    static constexpr int kCount{ 4 };
+    using Floats = __m128;
+    using Ints = __m128i;
+    static Floats set1(float value) { return _mm_set1_ps(value); }
+    static Ints set1(uint32_t value) { return _mm_set1_epi32(static_cast<int32_t>(value)); }
+    static Ints laneIndex() { return _mm_setr_epi32(0, 1, 2, 3); }
+    static Floats add(Floats a, Floats b) { return _mm_add_ps(a, b); }
+    static Floats sub(Floats a, Floats b) { return _mm_sub_ps(a, b); }
+    static Floats mul(Floats a, Floats b) { return _mm_mul_ps(a, b); }
+    static Ints add(Ints a, Ints b) { return _mm_add_epi32(a, b); }
+    //SSE2 has no 32 bit multiply that keeps the low halves - the even and odd lanes are done with the 64 bit one
+    static Ints mul(Ints a, Ints b)
+    {
+        const __m128i even = _mm_mul_epu32(a, b);
+        const __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+    static Ints bitXor(Ints a, Ints b) { return _mm_xor_si128(a, b); }
+    template <int kBits> static Ints shiftRight(Ints a) { return _mm_srli_epi32(a, kBits); }
+    static Ints truncate(Floats a) { return _mm_cvttps_epi32(a); }
+    static Floats toFloat(Ints a) { return _mm_cvtepi32_ps(a); }
+    static void store(float* p, Floats a) { _mm_storeu_ps(p, a); }
+};
+#else
+struct Lanes
+{
+    static constexpr int kCount{ 1 };
+    using Floats = float;
+    using Ints = uint32_t;
+    static Floats set1(float value) { return value; }
+    static Ints set1(uint32_t value) { return value; }
+    static Ints laneIndex() { return 0; }
+    static Floats add(Floats a, Floats b) { return a + b; }
+    static Floats sub(Floats a, Floats b) { return a - b; }
+    static Floats mul(Floats a, Floats b) { return a * b; }
+    static Ints add(Ints a, Ints b) { return a + b; }
+    static Ints mul(Ints a, Ints b) { return a * b; }
+    static Ints bitXor(Ints a, Ints b) { return a ^ b; }
+    template <int kBits> static Ints shiftRight(Ints a) { return a >> kBits; }
+    static Ints truncate(Floats a) { return static_cast<uint32_t>(static_cast<int32_t>(a)); }
+    static Floats toFloat(Ints a) { return static_cast<float>(static_cast<int32_t>(a)); }
+    static void store(float* p, Floats a) { *p = a; }
+};
+#endif
+
+using Floats = Lanes::Floats;
+using Ints = Lanes::Ints;
+
+//Random value from 0 to 1 for a lattice point - an integer hash of x, z and the seed
+Floats latticeValue(Ints x, Ints z, Ints seed)
+{
+    Ints hash = Lanes::bitXor(seed, Lanes::mul(x, Lanes::set1(0x9E3779B1u)));
+    hash = Lanes::bitXor(hash, Lanes::mul(z, Lanes::set1(0x85EBCA77u)));
+    hash = Lanes::bitXor(hash, Lanes::shiftRight<15>(hash));
+    hash = Lanes::mul(hash, Lanes::set1(0x2C1B3C6Du));
+    hash = Lanes::bitXor(hash, Lanes::shiftRight<12>(hash));
+    hash = Lanes::mul(hash, Lanes::set1(0x297A2D39u));
+    hash = Lanes::bitXor(hash, Lanes::shiftRight<15>(hash));
+    //The top 24 bits, as a float has 24 bits of precision
+    return Lanes::mul(Lanes::toFloat(Lanes::shiftRight<8>(hash)), Lanes::set1(1.f / 16777216.f));
+}
+
+//smoothstep: 3t^2 - 2t^3, so the slope is 0 at the lattice points
+Floats smooth(Floats t)
+{
+    return Lanes::mul(Lanes::mul(t, t), Lanes::sub(Lanes::set1(3.f), Lanes::mul(Lanes::set1(2.f), t)));
+}
+
+Floats lerp(Floats a, Floats b, Floats t)
+{
+    return Lanes::add(a, Lanes::mul(Lanes::sub(b, a), t));
+}
+
+//Lanes::kCount samples of the row, from firstColumn
+void sampleLanes(const FractalNoise::Settings& settings, int row, int firstColumn, float* values)
+{
+    const Floats x = Lanes::toFloat(Lanes::add(Lanes::set1(static_cast<uint32_t>(firstColumn)), Lanes::laneIndex()));
+    const Floats z = Lanes::set1(static_cast<float>(row));
+    const Ints one = Lanes::set1(1u);
+
+    Floats sum = Lanes::set1(0.f);
+    float frequency = settings.frequency;
+    float amplitude = 1.f;
+    float amplitudeSum = 0.f;
+    for (int octave = 0; octave < settings.octaves; octave++)
+    {
+        //The coordinates are never negative, so truncating is the same as floor
+        const Floats latticeX = Lanes::mul(x, Lanes::set1(frequency));
+        const Floats latticeZ = Lanes::mul(z, Lanes::set1(frequency));
+        const Ints cellX = Lanes::truncate(latticeX);
+        const Ints cellZ = Lanes::truncate(latticeZ);
+        const Floats tx = smooth(Lanes::sub(latticeX, Lanes::toFloat(cellX)));
+        const Floats tz = smooth(Lanes::sub(latticeZ, Lanes::toFloat(cellZ)));
+
+        //Each octave its own lattice values
+        const Ints seed = Lanes::set1(settings.seed + static_cast<uint32_t>(octave) * 0x68E31DA4u);
+        const Floats value00 = latticeValue(cellX, cellZ, seed);
+        const Floats value10 = latticeValue(Lanes::add(cellX, one), cellZ, seed);
+        const Floats value01 = latticeValue(cellX, Lanes::add(cellZ, one), seed);
+        const Floats value11 = latticeValue(Lanes::add(cellX, one), Lanes::add(cellZ, one), seed);
+        const Floats value = lerp(lerp(value00, value10, tx), lerp(value01, value11, tx), tz);
+
+        sum = Lanes::add(sum, Lanes::mul(value, Lanes::set1(amplitude)));
+        amplitudeSum += amplitude;
+        amplitude *= settings.gain;
+        frequency *= settings.lacunarity;
+    }
+    Lanes::store(values, Lanes::mul(sum, Lanes::set1(amplitudeSum > 0.f ? 1.f / amplitudeSum : 0.f)));
+}
+
+//Rows per thread in makeHeightSamples()
+constexpr size_t kMinNoiseRowsPerThread{ 16 };
+}
+
+void FractalNoise::sampleRow(int row, int firstColumn, int count, float* values) const
+{
+    int i{ 0 };
+    for (; i + Lanes::kCount <= count; i += Lanes::kCount)
+        sampleLanes(mSettings, row, firstColumn + i, values + i);
+
+    //The last few as a whole set of lanes, so they are made the same way as the rest
+    if (i < count)
+    {
+        float rest[Lanes::kCount];
+        sampleLanes(mSettings, row, firstColumn + i, rest);
+        std::copy(rest, rest + (count - i), values + i);
+    }
+}
+
+std::vector<uint16_t> FractalNoise::makeHeightSamples(int width, int depth) const
+{
+    std::vector<uint16_t> samples(static_cast<size_t>(std::max(width, 0)) * std::max(depth, 0));
+    runInBands(static_cast<size_t>(std::max(depth, 0)), kMinNoiseRowsPerThread, [&](size_t firstRow, size_t lastRow) {
+        std::vector<float> values(width);
+        for (size_t row = firstRow; row < lastRow; row++)
+        {
+            sampleRow(static_cast<int>(row), 0, width, values.data());
+            uint16_t* rowSamples = samples.data() + row * width;
+            for (int w = 0; w < width; w++)
+                rowSamples[w] = static_cast<uint16_t>(std::lrint(std::clamp(values[w], 0.f, 1.f) * 65535.f));
+        }
+    });
+    return samples;
+}
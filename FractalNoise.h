@@ -0,0 +1,40 @@
+#ifndef FRACTALNOISE_H
+#define FRACTALNOISE_H
+
+#include <cstdint>
+#include <vector>
+
+//Fractal value noise (fBm) for making heightmaps of any size without an image - ie. to test the terrain code with
+//big terrains. Each octave is value noise - random values on an integer lattice, hashed from the lattice point and the seed,
+//blended with smoothstep - with higher frequency and lower amplitude than the one before.
+//The same settings give the same terrain, however the rows are split between threads.
+//A row is done 8 samples at a time with AVX2, 4 with SSE2
+class FractalNoise
+{
+public:
+    struct Settings
+    {
+        uint32_t seed{ 1 };
+        int octaves{ 8 };
+        float frequency{ 1.f / 512.f };     //lattice cells per sample in the first octave
+        float lacunarity{ 2.f };            //frequency multiplier from one octave to the next
+        float gain{ .5f };                  //amplitude multiplier from one octave to the next
+    };
+
+    FractalNoise() = default;
+    explicit FractalNoise(const Settings& settings) : mSettings(settings) {}
+
+    const Settings& getSettings() const { return mSettings; }
+
+    //Noise from 0 to 1 at x = firstColumn ... firstColumn + count - 1 and z = row, in samples
+    void sampleRow(int row, int firstColumn, int count, float* values) const;
+
+    //A width x depth heightmap of 16 bit samples, row-major - for HeightMap::makeTerrain().
+    //The rows are made on all cores
+    std::vector<uint16_t> makeHeightSamples(int width, int depth) const;
+
+private:
+    Settings mSettings{};
+};
+
+#endif // FRACTALNOISE_H
@@ -0,0 +1,49 @@
+#include "Frustum.h"
+
+//Gribb & Hartmann: the planes are sums and differences of the rows of the matrix
+Frustum::Frustum(const QMatrix4x4& viewProjection)
+{
+    const QVector4D row0 = viewProjection.row(0);
+    const QVector4D row1 = viewProjection.row(1);
+    const QVector4D row2 = viewProjection.row(2);
+    const QVector4D row3 = viewProjection.row(3);
+
+    mPlanes[0] = row3 + row0;   //left
+    mPlanes[1] = row3 - row0;   //right
+    mPlanes[2] = row3 + row1;   //bottom
+    mPlanes[3] = row3 - row1;   //top
+    mPlanes[4] = row3 + row2;   //near
+    mPlanes[5] = row3 - row2;   //far
+
+    //Normalize, so the plane equation gives the distance to the plane
+    for (QVector4D& plane : mPlanes)
+    {
+        const float length = plane.toVector3D().length();
+        if (length > 0.f)
+            plane = plane / length;
+    }
+}
+
+bool Frustum::intersectsSphere(const QVector3D& center, float radius) const
+{
+    for (const QVector4D& plane : mPlanes)
+    {
+        if (QVector3D::dotProduct(plane.toVector3D(), center) + plane.w() < -radius)
+            return false;
+    }
+    return true;
+}
+
+bool Frustum::intersectsBox(const QVector3D& minimum, const QVector3D& maximum) const
+{
+    for (const QVector4D& plane : mPlanes)
+    {
+        //The corner furthest along the plane normal - if it is outside, the whole box is
+        QVector3D corner(plane.x() >= 0.f ? maximum.x() : minimum.x(),
+                         plane.y() >= 0.f ? maximum.y() : minimum.y(),
+                         plane.z() >= 0.f ? maximum.z() : minimum.z());
+        if (QVector3D::dotProduct(plane.toVector3D(), corner) + plane.w() < 0.f)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <QMatrix4x4>
+#include <QVector3D>
+#include <QVector4D>
+
+//The six planes of a camera frustum, used to skip geometry the camera can't see.
+//Made from a (model) view projection matrix - with a model matrix included,
+//the planes are in the coordinate system of that model, so its bounds can be tested without transforming them
+class Frustum
+{
+public:
+    Frustum() = default;
+    explicit Frustum(const QMatrix4x4& viewProjection);
+
+    //True if some of the sphere/box is inside the frustum (can give true for some that are just outside)
+    bool intersectsSphere(const QVector3D& center, float radius) const;
+    bool intersectsBox(const QVector3D& minimum, const QVector3D& maximum) const;
+
+private:
+    //Planes as (a, b, c, d) with the normal pointing into the frustum: a*x + b*y + c*z + d >= 0 is inside
+    QVector4D mPlanes[6];
+};
+
+#endif // FRUSTUM_H
@@ -1,42 +1,198 @@
 #include "HeightMap.h"
 #include "Vertex.h"
 #include "stb_image.h"
+#include "MeshOptimizer.h"
+#include "Frustum.h"
+#include "FractalNoise.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <fstream>
+#include <bit>
+
+//SSE2 is always there on x86-64. AVX2 only when the compiler is told so (ie. -mavx2 or /arch:AVX2)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HEIGHTMAP_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define HEIGHTMAP_AVX2
+#include <immintrin.h>
+#endif
+
+namespace
+{
+//Rows per thread should be at least this many, or starting the threads costs more than it saves
+constexpr size_t kMinRowsPerThread{ 64 };
+}
 
 HeightMap::HeightMap()
 { }
 
 void HeightMap::makeTerrain(std::string heightMapImage)
 {
+	if (!loadHeightMapFile(heightMapImage))
+	    return;
+	makeMesh();
+}
+
+bool HeightMap::loadHeightMapFile(const std::string& heightMapImage)
+{
+    //Raw 16 bit samples, ie. from a terrain editor - there is no header, so the heightmap must be square
+    const bool isRaw = heightMapImage.size() > 4 && heightMapImage.compare(heightMapImage.size() - 4, 4, ".r16") == 0;
+    if (isRaw)
+    {
+        std::ifstream file(heightMapImage, std::ios::binary | std::ios::ate);
+        const std::streamoff bytes = file ? static_cast<std::streamoff>(file.tellg()) : 0;
+        const int side = static_cast<int>(std::lround(std::sqrt(bytes / 2.0)));
+        if (side < 2 || static_cast<std::streamoff>(side) * side * 2 != bytes)
+        {
+            qDebug() << "Failed to load heightmap" << heightMapImage.c_str() << "- a .r16 file must be square";
+            return false;
+        }
+        std::vector<uint16_t> samples(static_cast<size_t>(side) * side);
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(samples.data()), bytes);
+        //The file is little-endian
+        if constexpr (std::endian::native == std::endian::big)
+            for (uint16_t& sample : samples)
+                sample = static_cast<uint16_t>((sample >> 8) | (sample << 8));
+        mWidth = mHeight = side;
+        mChannels = 1;
+        readHeights(samples.data(), 1, side, side, defaultPlacement(side, side, 16));
+        return true;
+    }
+
 	//Load the heightmap image
-	//Using stb_image to load the image
-	stbi_uc* pixelData = stbi_load(heightMapImage.c_str(), &mWidth, &mHeight, &mChannels, STBI_rgb_alpha);
+	//Using stb_image to load the image - one channel only, the others would be thrown away
+    if (stbi_is_16_bit(heightMapImage.c_str()))
+    {
+        stbi_us* pixelData = stbi_load_16(heightMapImage.c_str(), &mWidth, &mHeight, &mChannels, 1);
+        if (pixelData == nullptr)
+        {
+            qDebug() << "Failed to load heightmap image!";
+            return false;
+        }
+        readHeights(pixelData, 1, mWidth, mHeight, defaultPlacement(mWidth, mHeight, 16));
+        stbi_image_free(pixelData);
+        return true;
+    }
+	stbi_uc* pixelData = stbi_load(heightMapImage.c_str(), &mWidth, &mHeight, &mChannels, STBI_grey);
 	if (pixelData == nullptr)
     {
 	    qDebug() << "Failed to load heightmap image!";
-	    return;
+	    return false;
 	}
-	//Make the terrain from the pixel data
-	makeTerrain(pixelData, mWidth, mHeight);
+    readHeights(pixelData, 1, mWidth, mHeight, defaultPlacement(mWidth, mHeight, 8));
 	stbi_image_free(pixelData);
-
+    return true;
 }
 
-//Function that makes a terrain grid from a heightmap, using the values in the heightmap as height.
-//This function will crash if the width and height of the heightmap is not set correct!
-//The size of the textureData array is widthIn * heightIn.
-// The function is not tested in this codebase, and is provided as an example.
+//Makes a terrain grid from RGBA pixels, one grid point per pixel, with the R value as height.
+//textureData must hold widthIn * heightIn pixels of 4 bytes, row by row. A side shorter than 2 gives no triangles
 void HeightMap::makeTerrain(unsigned char* textureData, int widthIn, int heightIn)
 {
-    //Default normal pointing straight up - should be calculated correctly for lights to work!!!
-    float normal[3]{0.f, 1.f, 0.f};
+    readHeights(textureData, 4, widthIn, heightIn, defaultPlacement(widthIn, heightIn, 8));
+    makeMesh();
+}
+
+void HeightMap::makeTerrain(const unsigned char* samples, int width, int depth, const TerrainPlacement& placement)
+{
+    readHeights(samples, 1, width, depth, placement);
+    makeMesh();
+}
+
+void HeightMap::makeTerrain(const uint16_t* samples, int width, int depth, const TerrainPlacement& placement)
+{
+    readHeights(samples, 1, width, depth, placement);
+    makeMesh();
+}
+
+void HeightMap::makeMesh()
+{
+    //x and z are given by the place in the grid, so each vertex is only its sample and normal.
+    //The normal points straight up until calculateHeighMapNormals() is done with the grid
+    mVertices.clear();
+    mVertices.shrink_to_fit();
+    if (mHeightSamples.size() >= kPrimitiveRestart)
+    {
+        qWarning("HeightMap: %zu samples are too many for 32 bit indices - use makeDisplacedTerrain()", mHeightSamples.size());
+        mTerrainVertices.clear();
+        mIndices.clear();
+        mChunks.clear();
+        return;
+    }
+    //Each row on its own, so they can be made in parallel
+    mTerrainVertices.resize(mHeightSamples.size());
+    const size_t width = static_cast<size_t>(mGridWidth);
+    runInBands(static_cast<size_t>(mGridDepth), kMinRowsPerThread, [&](size_t firstD, size_t lastD) {
+        for (size_t i = firstD * width; i < lastD * width; i++)
+            mTerrainVertices[i] = TerrainVertex{ mHeightSamples[i], 0, 0 };
+    });
+
+    //The samples are in the vertices now
+    mHeightSamples.clear();
+    mHeightSamples.shrink_to_fit();
+
+    makeChunks(true);
+ 
+	//Calculating the normals for the mesh
+    calculateHeighMapNormals();
+}
 
+void HeightMap::makeDisplacedTerrain(std::string heightMapImage)
+{
+	if (!loadHeightMapFile(heightMapImage))
+	    return;
+	makeDisplaced();
+}
+
+void HeightMap::makeDisplacedTerrain(unsigned char* textureData, int widthIn, int heightIn)
+{
+    readHeights(textureData, 4, widthIn, heightIn, defaultPlacement(widthIn, heightIn, 8));
+    makeDisplaced();
+}
+
+void HeightMap::makeNoiseTerrain(int width, int depth, const FractalNoise& noise)
+{
+    const std::vector<uint16_t> samples = noise.makeHeightSamples(width, depth);
+    makeTerrain(samples.data(), width, depth, defaultPlacement(width, depth, 16));
+}
+
+void HeightMap::makeDisplacedNoiseTerrain(int width, int depth, const FractalNoise& noise)
+{
+    const std::vector<uint16_t> samples = noise.makeHeightSamples(width, depth);
+    readHeights(samples.data(), 1, width, depth, defaultPlacement(width, depth, 16));
+    makeDisplaced();
+}
+
+void HeightMap::makeDisplaced()
+{
+    //No mesh - the vertex shader makes it from the shared patch and mHeightSamples
+    mVertices.clear();
+    mVertices.shrink_to_fit();
+    mTerrainVertices.clear();
+    mTerrainVertices.shrink_to_fit();
+    mIndices.clear();
+    mIndices.shrink_to_fit();
+    makeChunks(false);
+    mDisplaced = true;
+
+    qDebug() << mName.c_str() << "displaced terrain" << mGridWidth << "x" << mGridDepth << mSampleBits << "bit -"
+             << (mHeights.size() * sizeof(float) + mHeightSamples.size() * sizeof(uint16_t)) / 1024 << "kB on the CPU, a full mesh would need"
+             << mHeights.size() * (sizeof(TerrainVertex) + sizeof(float) + 6 * sizeof(uint32_t)) / 1024 << "kB";
+}
+
+TerrainPlacement HeightMap::defaultPlacement(int width, int depth, int sampleBits)
+{
     //How many meters between each vertex in both x and z direction
     //This should be sent in as a parameter!
     float horisontalSpacing{.2f};
 
     //Scaling the height read from the heightmap. 0 -> 255 meters if this is set to 1
     //This should be sent in as a parameter!
-    float heightSpacing{.02f};
+    //16 bit samples get the same range in 257 times finer steps (65535 = 255 * 257)
+    float heightSpacing{ sampleBits == 16 ? .02f / 257.f : .02f };
 
     //Offset the whole terrain in y (height) axis
     //Moves the terrain mesh up or down
@@ -44,33 +200,47 @@ void HeightMap::makeTerrain(unsigned char* textureData, int widthIn, int heightI
 	//So we don't want to move the terrain up or down in the Y axis after it is made
     float heightPlacement{-10.f};
 
-    //Getting the scale of the heightmap
-    //Using depth as the name of texture height, to not confuse with terrain height
-    unsigned short width = widthIn;       //Width == x-axis
-    unsigned short depth = heightIn;      //Depth == z-axis
-
     //Temp variables for creating the mesh
     //Adding offset so the middle of the terrain will be in World origo
+    //Using depth as the name of texture height, to not confuse with terrain height
     float vertexXStart{ 0.f - width * horisontalSpacing / 2 };            // if world origo should be at center use: {0.f - width * horisontalSpacing / 2};
     float vertexZStart{ 0.f + depth * horisontalSpacing / 2 };            // if world origo should be at center use: {0.f + depth * horisontalSpacing / 2};
 
-    //Loop to make the mesh from the values read from the heightmap (textureData)
-	//Double for-loop to make the depth and the width of the terrain in one go
-    for(int d{0}; d < depth; ++d)       //depth loop
-    {
-        for(int w{0}; w < width; ++w)   //width loop
+    return { vertexXStart, vertexZStart, horisontalSpacing, heightSpacing, heightPlacement };
+}
+
+template <typename Sample>
+void HeightMap::readHeights(const Sample* samples, size_t sampleStride, int width, int depth, const TerrainPlacement& placement)
+{
+    //Remembering the grid, so getHeightAt() can find the cell under a position directly
+    mGridWidth = width;
+    mGridDepth = depth;
+    mSpacing = placement.spacing;
+    mOriginX = placement.originX;
+    mOriginZ = placement.originZ;
+    mHeightScale = placement.heightScale;
+    mHeightOffset = placement.heightOffset;
+    mDisplaced = false;
+    mSampleBits = 8 * sizeof(Sample);
+    const size_t rowLength = static_cast<size_t>(width);
+    mHeights.resize(rowLength * depth);
+    mHeightSamples.resize(mHeights.size());
+
+    //Heightmap image is actually stored as an one dimentional array - so calculating the correct index for column and row
+    //and scale it according to variables. Bands of rows in parallel
+    runInBands(static_cast<size_t>(depth), kMinRowsPerThread, [&](size_t firstD, size_t lastD) {
+        for (size_t i = firstD * rowLength; i < lastD * rowLength; i++)
         {
-            //Heightmap image is actually stored as an one dimentional array - so calculating the correct index for column and row
-            //and scale it according to variables
-            // Calculate the correct index for the R value of each pixel
-            int index = (w + d * width) * 4; // Each pixel has 4 bytes (RGBA)
-            float heightFromBitmap = static_cast<float>(textureData[index]) * heightSpacing + heightPlacement;
-			//                                          x - value                      y-value               z-value
-            mVertices.emplace_back(Vertex{vertexXStart + (w * horisontalSpacing), heightFromBitmap, vertexZStart - (d * horisontalSpacing),
-				//  dummy normal=0,1,0                  Texture coordinates
-                normal[0],normal[1],normal[2],           w / (width - 1.f), d / (depth - 1.f)});
+            mHeightSamples[i] = samples[i * sampleStride];
+            mHeights[i] = static_cast<float>(mHeightSamples[i]) * placement.heightScale + placement.heightOffset;
         }
-    }
+    });
+}
+
+void HeightMap::makeChunks(bool withIndices)
+{
+    const size_t width = static_cast<size_t>(mGridWidth);
+    const size_t depth = static_cast<size_t>(mGridDepth);
 
     // The mesh(grid) is drawn in quads with diagonals from lower left to upper right
     //          _ _
@@ -78,62 +248,699 @@ void HeightMap::makeTerrain(unsigned char* textureData, int widthIn, int heightI
     //          - -
     //         |/|/|
     //          - -
-    //Making the indices for this mesh:
-    for(int d{0}; d < depth-1; ++d)        //depth - 1 because we draw the last quad from depth - 1 and in negative z direction
+    //Making the indices for this mesh, one chunk of kChunkQuads x kChunkQuads quads at a time,
+    //so each chunk is one range in the index buffer that can be culled on its own.
+    //As triangle strips, each row of quads in a chunk is one strip going along the row, taking a vertex from the row below
+    //(d + 1) then from the row itself - that gives the same triangles and diagonals as the list. Each strip ends with
+    //kPrimitiveRestart, so chunks after each other in the index buffer can be drawn together.
+    //The number of indices of each chunk is known up front, so the index buffer is allocated once,
+    //and the chunks are filled in parallel, each in its own range
+    mChunks.clear();
+    mIndices.clear();
+    if (width < 2 || depth < 2)
+        return;
+    const size_t chunksW = (width - 2) / kChunkQuads + 1;
+    const size_t chunksD = (depth - 2) / kChunkQuads + 1;
+    mChunks.resize(chunksW * chunksD);
+    size_t indexCount{ 0 };
+    for (size_t c = 0; c < mChunks.size(); c++)
     {
-        for(int w{0}; w < width-1; ++w)    //width - 1 because we draw the last quad from width - 1 and in positive x direction
+        const size_t quadsW = std::min<size_t>(kChunkQuads, width - 1 - (c % chunksW) * kChunkQuads);
+        const size_t quadsD = std::min<size_t>(kChunkQuads, depth - 1 - (c / chunksW) * kChunkQuads);
+        const size_t chunkIndices = !withIndices ? 0 : mTriangleStrips ? quadsD * (2 * (quadsW + 1) + 1) : quadsD * quadsW * 6;
+        mChunks[c].firstIndex = static_cast<uint32_t>(indexCount);
+        mChunks[c].indexCount = static_cast<uint32_t>(chunkIndices);
+        indexCount += chunkIndices;
+    }
+    if (indexCount > kPrimitiveRestart)
+        qWarning("HeightMap: %zu indices do not fit in 32 bit draw calls", indexCount);
+    mIndices.resize(indexCount);
+
+    runInBands(mChunks.size(), 4, [&](size_t firstChunk, size_t lastChunk) {
+        for (size_t c = firstChunk; c < lastChunk; c++)
         {
-			//Indices for one quad:
-            mIndices.emplace_back(w + d * width);               // 0 + 0 * mWidth               = 0
-            mIndices.emplace_back(w + d * width + width + 1);   // 0 + 0 * mWidth + mWidth + 1  = mWidth + 1
-            mIndices.emplace_back(w + d * width + width);       // 0 + 0 * mWidth + mWidth      = mWidth
-            mIndices.emplace_back(w + d * width);               // 0 + 0 * mWidth               = 0
-            mIndices.emplace_back(w + d * width + 1);           // 0 + 0 * mWidth + 1           = 1
-            mIndices.emplace_back(w + d * width + width + 1);   // 0 + 0 * mWidth + mWidth + 1  = mWidth + 1
+            TerrainChunk& chunk = mChunks[c];
+            const size_t chunkW = (c % chunksW) * kChunkQuads;
+            const size_t chunkD = (c / chunksW) * kChunkQuads;
+            const size_t lastD = std::min<size_t>(chunkD + kChunkQuads, depth - 1);
+            const size_t lastW = std::min<size_t>(chunkW + kChunkQuads, width - 1);
+            uint32_t* index = mIndices.data() + chunk.firstIndex;
+            for(size_t d{chunkD}; withIndices && mTriangleStrips && d < lastD; ++d)
+            {
+                for(size_t w{chunkW}; w <= lastW; ++w)
+                {
+                    *index++ = static_cast<uint32_t>(w + d * width + width);
+                    *index++ = static_cast<uint32_t>(w + d * width);
+                }
+                *index++ = kPrimitiveRestart;
+            }
+            for(size_t d{chunkD}; withIndices && !mTriangleStrips && d < lastD; ++d)   //depth - 1 because we draw the last quad from depth - 1 and in negative z direction
+            {
+                for(size_t w{chunkW}; w < lastW; ++w)  //width - 1 because we draw the last quad from width - 1 and in positive x direction
+                {
+                    //Indices for one quad:
+                    const uint32_t corner = static_cast<uint32_t>(w + d * width);
+                    *index++ = corner;                                      // 0 + 0 * mWidth               = 0
+                    *index++ = corner + static_cast<uint32_t>(width) + 1;   // 0 + 0 * mWidth + mWidth + 1  = mWidth + 1
+                    *index++ = corner + static_cast<uint32_t>(width);       // 0 + 0 * mWidth + mWidth      = mWidth
+                    *index++ = corner;                                      // 0 + 0 * mWidth               = 0
+                    *index++ = corner + 1;                                  // 0 + 0 * mWidth + 1           = 1
+                    *index++ = corner + static_cast<uint32_t>(width) + 1;   // 0 + 0 * mWidth + mWidth + 1  = mWidth + 1
+                }
+            }
+
+            //Bounding box - the lowest and highest sample of the chunk, including its edge vertices
+            float minHeight = mHeights[chunkW + chunkD * width];
+            float maxHeight = minHeight;
+            for(size_t d{chunkD}; d <= lastD; ++d)
+            {
+                const auto [low, high] = std::minmax_element(mHeights.begin() + chunkW + d * width, mHeights.begin() + lastW + 1 + d * width);
+                minHeight = std::min(minHeight, *low);
+                maxHeight = std::max(maxHeight, *high);
+            }
+            chunk.boundsMin = QVector3D(mOriginX + chunkW * mSpacing, minHeight, mOriginZ - lastD * mSpacing);
+            chunk.boundsMax = QVector3D(mOriginX + lastW * mSpacing, maxHeight, mOriginZ - chunkD * mSpacing);
         }
+    });
+
+    buildLodTree();
+    buildMinMaxPyramid();
+}
+
+void HeightMap::buildLodTree()
+{
+    mLodNodes.clear();
+    if (mChunks.empty())
+        return;
+
+    //Level 0 - the chunks, in the same order
+    int nodesW = (mGridWidth - 2) / kChunkQuads + 1;
+    int nodesD = (mGridDepth - 2) / kChunkQuads + 1;
+    std::vector<int> level(mChunks.size());
+    for (size_t i = 0; i < mChunks.size(); i++)
+    {
+        TerrainLodNode node;
+        node.startW = static_cast<int>(i % nodesW) * kChunkQuads;
+        node.startD = static_cast<int>(i / nodesW) * kChunkQuads;
+        node.boundsMin = mChunks[i].boundsMin;
+        node.boundsMax = mChunks[i].boundsMax;
+        level[i] = static_cast<int>(mLodNodes.size());
+        mLodNodes.push_back(node);
     }
 
- 
-	//Calculating the normals for the mesh
-    //Function not made yet:
-    //calculateHeighMapNormals();
+    //Each level up has a node for each 2 x 2 nodes below it, until there is one
+    for (int levelIndex = 1; nodesW > 1 || nodesD > 1; levelIndex++)
+    {
+        const int parentsW = (nodesW + 1) / 2;
+        const int parentsD = (nodesD + 1) / 2;
+        std::vector<int> parents(static_cast<size_t>(parentsW) * parentsD);
+        for (int d = 0; d < parentsD; d++)
+        {
+            for (int w = 0; w < parentsW; w++)
+            {
+                TerrainLodNode parent;
+                parent.level = levelIndex;
+                parent.startW = w * (kChunkQuads << levelIndex);
+                parent.startD = d * (kChunkQuads << levelIndex);
+                bool first{ true };
+                for (int q = 0; q < 4; q++)
+                {
+                    const int childW = 2 * w + (q & 1);
+                    const int childD = 2 * d + (q >> 1);
+                    if (childW >= nodesW || childD >= nodesD)
+                        continue;
+                    parent.children[q] = level[childW + childD * nodesW];
+                    const TerrainLodNode& child = mLodNodes[parent.children[q]];
+                    parent.boundsMin = first ? child.boundsMin : QVector3D(std::min(parent.boundsMin.x(), child.boundsMin.x()),
+                        std::min(parent.boundsMin.y(), child.boundsMin.y()), std::min(parent.boundsMin.z(), child.boundsMin.z()));
+                    parent.boundsMax = first ? child.boundsMax : QVector3D(std::max(parent.boundsMax.x(), child.boundsMax.x()),
+                        std::max(parent.boundsMax.y(), child.boundsMax.y()), std::max(parent.boundsMax.z(), child.boundsMax.z()));
+                    first = false;
+                }
+                parents[w + d * parentsW] = static_cast<int>(mLodNodes.size());
+                mLodNodes.push_back(parent);
+            }
+        }
+        level = std::move(parents);
+        nodesW = parentsW;
+        nodesD = parentsD;
+    }
+}
+
+namespace
+{
+float distanceToBox(const QVector3D& position, const TerrainLodNode& node)
+{
+    const float dx = std::max({ node.boundsMin.x() - position.x(), 0.f, position.x() - node.boundsMax.x() });
+    const float dy = std::max({ node.boundsMin.y() - position.y(), 0.f, position.y() - node.boundsMax.y() });
+    const float dz = std::max({ node.boundsMin.z() - position.z(), 0.f, position.z() - node.boundsMax.z() });
+    return std::sqrt(dx * dx + dy * dy + dz * dz);
+}
+}
+
+void HeightMap::selectLod(const QVector3D& cameraPosition, const Frustum& frustum, std::vector<TerrainLodSelection>& selection) const
+{
+    selection.clear();
+    if (!mLodNodes.empty())
+        selectLodNode(static_cast<int>(mLodNodes.size()) - 1, cameraPosition, frustum, selection);
+}
+
+void HeightMap::selectLodNode(int index, const QVector3D& cameraPosition, const Frustum& frustum, std::vector<TerrainLodSelection>& selection) const
+{
+    const TerrainLodNode& node = mLodNodes[index];
+    if (!frustum.intersectsBox(node.boundsMin, node.boundsMax))
+        return;
+
+    //The quadrants inside the grid. The chunks have no children, and are drawn whole
+    uint32_t quadrants{ 0 };
+    for (int q = 0; q < 4; q++)
+        quadrants |= (node.level == 0 || node.children[q] >= 0) ? 1u << q : 0u;
+
+    //Too close for this level - the children close enough for the level below are split further,
+    //the rest are drawn as quadrants of this node
+    if (node.level > 0 && distanceToBox(cameraPosition, node) < getLodRange(node.level - 1))
+    {
+        for (int q = 0; q < 4; q++)
+        {
+            if (node.children[q] < 0)
+                continue;
+            const TerrainLodNode& child = mLodNodes[node.children[q]];
+            if (distanceToBox(cameraPosition, child) < getLodRange(node.level - 1))
+            {
+                selectLodNode(node.children[q], cameraPosition, frustum, selection);
+                quadrants &= ~(1u << q);
+            }
+            else if (!frustum.intersectsBox(child.boundsMin, child.boundsMax))
+                quadrants &= ~(1u << q);
+        }
+    }
+    if (quadrants == 0)
+        return;
+
+    //The root has no level above to morph into
+    const bool isRoot = index == static_cast<int>(mLodNodes.size()) - 1;
+    const float morphEnd = isRoot ? std::numeric_limits<float>::max() : getLodRange(node.level);
+    selection.push_back({ static_cast<uint32_t>(index), quadrants, kLodMorphStart * morphEnd, morphEnd });
+}
+
+void HeightMap::calculateHeighMapNormals()
+{
+    calculateHeighMapNormals(0, 0, mGridWidth, mGridDepth);
+}
+
+void HeightMap::calculateHeighMapNormals(int firstW, int firstD, int lastW, int lastD)
+{
+    firstW = std::max(firstW, 0);
+    firstD = std::max(firstD, 0);
+    lastW = std::min(lastW, mGridWidth);
+    lastD = std::min(lastD, mGridDepth);
+    if (firstW >= lastW || firstD >= lastD || mTerrainVertices.size() != mHeights.size())
+        return;
+
+    runInBands(static_cast<size_t>(lastD - firstD), kMinRowsPerThread, [&](size_t bandFirst, size_t bandLast) {
+        for (size_t d = bandFirst; d < bandLast; d++)
+            calculateNormalsInRow(firstD + static_cast<int>(d), firstW, lastW);
+    });
+}
+
+//The normal of the height field h(x, z) is (-dh/dx, 1, -dh/dz), here scaled by 2 * spacing to save a division:
+//(h[w - 1] - h[w + 1], 2 * spacing, h[d + 1] - h[d - 1]) - z shrinks as d grows, so the z difference is turned around.
+//On the edges of the grid the one sided difference is used, scaled up to the same length
+void HeightMap::calculateNormalsInRow(int d, int firstW, int lastW)
+{
+    const float* row = mHeights.data() + static_cast<size_t>(d) * mGridWidth;
+    const float* rowUp = d > 0 ? row - mGridWidth : row;                    //d - 1
+    const float* rowDown = d < mGridDepth - 1 ? row + mGridWidth : row;     //d + 1
+    const float zScale = (d > 0 && d < mGridDepth - 1) ? 1.f : 2.f;
+    const float twoSpacing = 2.f * mSpacing;
+    TerrainVertex* vertices = mTerrainVertices.data() + static_cast<size_t>(d) * mGridWidth;
+    //x and z of the unit normal, rounded to 8 bits
+    auto pack = [](TerrainVertex& vertex, float x, float z) {
+        vertex.normalX = static_cast<int8_t>(std::lrint(x * 127.f));
+        vertex.normalZ = static_cast<int8_t>(std::lrint(z * 127.f));
+    };
+
+    auto normalAt = [&](int w) {
+        const int left = std::max(w - 1, 0);
+        const int right = std::min(w + 1, mGridWidth - 1);
+        const float nx = (row[left] - row[right]) * (2.f / (right - left));
+        const float ny = twoSpacing;
+        const float nz = (rowDown[w] - rowUp[w]) * zScale;
+        const float inverseLength = 1.f / std::sqrt(nx * nx + ny * ny + nz * nz);
+        pack(vertices[w], nx * inverseLength, nz * inverseLength);
+    };
+
+    //The first and last column have no neighbour on one side
+    int w = firstW;
+    if (w == 0 && w < lastW)
+        normalAt(w++);
+    const int lastInside = std::min(lastW, mGridWidth - 1);
+
+#if defined(HEIGHTMAP_AVX2) || defined(HEIGHTMAP_SSE2)
+#if defined(HEIGHTMAP_AVX2)
+    constexpr int kLanes{ 8 };
+    using Floats = __m256;
+    auto load = [](const float* p) { return _mm256_loadu_ps(p); };
+    auto set1 = [](float value) { return _mm256_set1_ps(value); };
+    auto add = [](Floats a, Floats b) { return _mm256_add_ps(a, b); };
+    auto sub = [](Floats a, Floats b) { return _mm256_sub_ps(a, b); };
+    auto mul = [](Floats a, Floats b) { return _mm256_mul_ps(a, b); };
+    auto div = [](Floats a, Floats b) { return _mm256_div_ps(a, b); };
+    auto sqrt = [](Floats a) { return _mm256_sqrt_ps(a); };
+    auto store = [](float* p, Floats a) { _mm256_storeu_ps(p, a); };
+#else
+    constexpr int kLanes{ 4 };
+    using Floats = __m128;
+    auto load = [](const float* p) { return _mm_loadu_ps(p); };
+    auto set1 = [](float value) { return _mm_set1_ps(value); };
+    auto add = [](Floats a, Floats b) { return _mm_add_ps(a, b); };
+    auto sub = [](Floats a, Floats b) { return _mm_sub_ps(a, b); };
+    auto mul = [](Floats a, Floats b) { return _mm_mul_ps(a, b); };
+    auto div = [](Floats a, Floats b) { return _mm_div_ps(a, b); };
+    auto sqrt = [](Floats a) { return _mm_sqrt_ps(a); };
+    auto store = [](float* p, Floats a) { _mm_storeu_ps(p, a); };
+#endif
+    const Floats ny = set1(twoSpacing);
+    const Floats nyy = mul(ny, ny);
+    const Floats zScales = set1(zScale);
+    const Floats one = set1(1.f);
+    alignas(32) float nx[kLanes], nz[kLanes];
+    for (; w + kLanes <= lastInside; w += kLanes)
+    {
+        const Floats x = sub(load(row + w - 1), load(row + w + 1));
+        const Floats z = mul(sub(load(rowDown + w), load(rowUp + w)), zScales);
+        const Floats inverseLength = div(one, sqrt(add(add(mul(x, x), nyy), mul(z, z))));
+        store(nx, mul(x, inverseLength));
+        store(nz, mul(z, inverseLength));
+        for (int lane = 0; lane < kLanes; lane++)
+            pack(vertices[w + lane], nx[lane], nz[lane]);
+    }
+#endif
+
+    //The rest, and the last column
+    for (; w < lastW; w++)
+        normalAt(w);
 }
 
 float HeightMap::getHeightAt(const QVector3D& positionXZ) const
 {
-    QVector2D point(positionXZ.x(), positionXZ.z());
+    if (mGridWidth < 2 || mGridDepth < 2)
+        return 0.0f;
 
-    for (size_t i = 0; i < mIndices.size(); i += 3) {
-        const Vertex& v0 = mVertices[mIndices[i]];
-        const Vertex& v1 = mVertices[mIndices[i + 1]];
-        const Vertex& v2 = mVertices[mIndices[i + 2]];
+    //Position in grid units - w along x, d along z
+    const float gridX = (positionXZ.x() - mOriginX) / mSpacing;
+    const float gridZ = (mOriginZ - positionXZ.z()) / mSpacing;
+    if (!(gridX >= 0.f && gridZ >= 0.f && gridX <= mGridWidth - 1.f && gridZ <= mGridDepth - 1.f))
+        return 0.0f;  // Default flat
 
-        QVector2D a(v0.x, v0.z);
-        QVector2D b(v1.x, v1.z);
-        QVector2D c(v2.x, v2.z);
+    //The cell, and where in the cell. The last row and column belong to the cell before them
+    const int w = std::min(static_cast<int>(gridX), mGridWidth - 2);
+    const int d = std::min(static_cast<int>(gridZ), mGridDepth - 2);
+    const float tx = gridX - w;
+    const float tz = gridZ - d;
 
-        QVector2D v0v2 = c - a;
-        QVector2D v0v1 = b - a;
-        QVector2D v0p = point - a;
+    const float* cell = mHeights.data() + w + static_cast<size_t>(d) * mGridWidth;
+    const float h00 = cell[0];
+    const float h10 = cell[1];
+    const float h01 = cell[mGridWidth];
+    const float h11 = cell[mGridWidth + 1];
 
-        float d00 = QVector2D::dotProduct(v0v1, v0v1);
-        float d01 = QVector2D::dotProduct(v0v1, v0v2);
-        float d11 = QVector2D::dotProduct(v0v2, v0v2);
-        float d20 = QVector2D::dotProduct(v0p, v0v1);
-        float d21 = QVector2D::dotProduct(v0p, v0v2);
+    //The quad is split along the diagonal from (w, d) to (w + 1, d + 1), see makeTerrain().
+    //Barycentric interpolation in the triangle the point is in
+    if (tz >= tx)   //triangle (w, d), (w + 1, d + 1), (w, d + 1)
+        return h00 + tx * (h11 - h01) + tz * (h01 - h00);
+    else            //triangle (w, d), (w + 1, d), (w + 1, d + 1)
+        return h00 + tx * (h10 - h00) + tz * (h11 - h10);
+}
+
+
+//The same steps as getHeightAt(), in the same order, a vector of positions at a time - so the results are the same to the bit.
+//Positions outside the terrain read height 0 from the start of mHeights, and are zeroed by the inside mask
+void HeightMap::getHeightsAt(std::span<const QVector2D> positionsXZ, std::span<float> heights) const
+{
+    const size_t count = std::min(positionsXZ.size(), heights.size());
+    if (mGridWidth < 2 || mGridDepth < 2)
+    {
+        std::fill(heights.begin(), heights.begin() + count, 0.f);
+        return;
+    }
+    //QVector2D is two floats, so the positions can be read as x, z, x, z, ...
+    static_assert(sizeof(QVector2D) == 2 * sizeof(float), "QVector2D must be two packed floats");
+    const float* xz = reinterpret_cast<const float*>(positionsXZ.data());
+    size_t i{ 0 };
 
-        float denom = d00 * d11 - d01 * d01;
-        if (denom == 0.0f) continue;
+#if defined(HEIGHTMAP_AVX2)
+    //The gathers take 32 bit indices
+    if (mHeights.size() <= static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+    {
+        const __m256 originX = _mm256_set1_ps(mOriginX);
+        const __m256 originZ = _mm256_set1_ps(mOriginZ);
+        const __m256 spacing = _mm256_set1_ps(mSpacing);
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 maxX = _mm256_set1_ps(mGridWidth - 1.f);
+        const __m256 maxZ = _mm256_set1_ps(mGridDepth - 1.f);
+        const __m256i lastCellW = _mm256_set1_epi32(mGridWidth - 2);
+        const __m256i lastCellD = _mm256_set1_epi32(mGridDepth - 2);
+        const __m256i rowLength = _mm256_set1_epi32(mGridWidth);
+        const __m256i one = _mm256_set1_epi32(1);
+        for (; i + 8 <= count; i += 8)
+        {
+            //x0 z0 x1 z1 ... into x0 x1 ... and z0 z1 ...
+            const __m256 first = _mm256_loadu_ps(xz + 2 * i);
+            const __m256 second = _mm256_loadu_ps(xz + 2 * i + 8);
+            const __m256 x = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(first, second, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+            const __m256 z = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(first, second, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+
+            const __m256 gridX = _mm256_div_ps(_mm256_sub_ps(x, originX), spacing);
+            const __m256 gridZ = _mm256_div_ps(_mm256_sub_ps(originZ, z), spacing);
+            const __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(gridX, zero, _CMP_GE_OQ), _mm256_cmp_ps(gridZ, zero, _CMP_GE_OQ)),
+                                                _mm256_and_ps(_mm256_cmp_ps(gridX, maxX, _CMP_LE_OQ), _mm256_cmp_ps(gridZ, maxZ, _CMP_LE_OQ)));
 
-        float v = (d11 * d20 - d01 * d21) / denom;
-        float w = (d00 * d21 - d01 * d20) / denom;
-        float u = 1.0f - v - w;
+            const __m256i w = _mm256_min_epi32(_mm256_cvttps_epi32(gridX), lastCellW);
+            const __m256i d = _mm256_min_epi32(_mm256_cvttps_epi32(gridZ), lastCellD);
+            const __m256 tx = _mm256_sub_ps(gridX, _mm256_cvtepi32_ps(w));
+            const __m256 tz = _mm256_sub_ps(gridZ, _mm256_cvtepi32_ps(d));
 
-        if (u >= 0.0f && v >= 0.0f && w >= 0.0f) {
-            return v0.y * u + v1.y * v + v2.y * w;
+            const __m256i index00 = _mm256_and_si256(_mm256_add_epi32(w, _mm256_mullo_epi32(d, rowLength)), _mm256_castps_si256(inside));
+            const __m256i index01 = _mm256_add_epi32(index00, rowLength);
+            const __m256 h00 = _mm256_i32gather_ps(mHeights.data(), index00, 4);
+            const __m256 h10 = _mm256_i32gather_ps(mHeights.data(), _mm256_add_epi32(index00, one), 4);
+            const __m256 h01 = _mm256_i32gather_ps(mHeights.data(), index01, 4);
+            const __m256 h11 = _mm256_i32gather_ps(mHeights.data(), _mm256_add_epi32(index01, one), 4);
+
+            const __m256 upper = _mm256_add_ps(_mm256_add_ps(h00, _mm256_mul_ps(tx, _mm256_sub_ps(h11, h01))), _mm256_mul_ps(tz, _mm256_sub_ps(h01, h00)));
+            const __m256 lower = _mm256_add_ps(_mm256_add_ps(h00, _mm256_mul_ps(tx, _mm256_sub_ps(h10, h00))), _mm256_mul_ps(tz, _mm256_sub_ps(h11, h10)));
+            const __m256 height = _mm256_blendv_ps(lower, upper, _mm256_cmp_ps(tz, tx, _CMP_GE_OQ));
+            _mm256_storeu_ps(heights.data() + i, _mm256_and_ps(height, inside));
         }
     }
+#endif
 
-    return 0.0f;  // Default flat
+#if defined(HEIGHTMAP_SSE2)
+    {
+        const __m128 originX = _mm_set1_ps(mOriginX);
+        const __m128 originZ = _mm_set1_ps(mOriginZ);
+        const __m128 spacing = _mm_set1_ps(mSpacing);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 maxX = _mm_set1_ps(mGridWidth - 1.f);
+        const __m128 maxZ = _mm_set1_ps(mGridDepth - 1.f);
+        const float* grid = mHeights.data();
+        alignas(16) int cells[4];
+        alignas(16) int rows[4];
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128 first = _mm_loadu_ps(xz + 2 * i);
+            const __m128 second = _mm_loadu_ps(xz + 2 * i + 4);
+            const __m128 x = _mm_shuffle_ps(first, second, _MM_SHUFFLE(2, 0, 2, 0));
+            const __m128 z = _mm_shuffle_ps(first, second, _MM_SHUFFLE(3, 1, 3, 1));
+
+            const __m128 gridX = _mm_div_ps(_mm_sub_ps(x, originX), spacing);
+            const __m128 gridZ = _mm_div_ps(_mm_sub_ps(originZ, z), spacing);
+            const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(gridX, zero), _mm_cmpge_ps(gridZ, zero)),
+                                             _mm_and_ps(_mm_cmple_ps(gridX, maxX), _mm_cmple_ps(gridZ, maxZ)));
+
+            //SSE2 has no integer min or gather - the cell indices are finished per lane
+            _mm_store_si128(reinterpret_cast<__m128i*>(cells), _mm_and_si128(_mm_cvttps_epi32(gridX), _mm_castps_si128(inside)));
+            _mm_store_si128(reinterpret_cast<__m128i*>(rows), _mm_and_si128(_mm_cvttps_epi32(gridZ), _mm_castps_si128(inside)));
+            for (int lane = 0; lane < 4; lane++)
+            {
+                cells[lane] = std::min(cells[lane], mGridWidth - 2);
+                rows[lane] = std::min(rows[lane], mGridDepth - 2);
+            }
+            const __m128 tx = _mm_sub_ps(gridX, _mm_cvtepi32_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(cells))));
+            const __m128 tz = _mm_sub_ps(gridZ, _mm_cvtepi32_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(rows))));
+
+            const float* p0 = grid + cells[0] + static_cast<size_t>(rows[0]) * mGridWidth;
+            const float* p1 = grid + cells[1] + static_cast<size_t>(rows[1]) * mGridWidth;
+            const float* p2 = grid + cells[2] + static_cast<size_t>(rows[2]) * mGridWidth;
+            const float* p3 = grid + cells[3] + static_cast<size_t>(rows[3]) * mGridWidth;
+            const __m128 h00 = _mm_setr_ps(p0[0], p1[0], p2[0], p3[0]);
+            const __m128 h10 = _mm_setr_ps(p0[1], p1[1], p2[1], p3[1]);
+            const __m128 h01 = _mm_setr_ps(p0[mGridWidth], p1[mGridWidth], p2[mGridWidth], p3[mGridWidth]);
+            const __m128 h11 = _mm_setr_ps(p0[mGridWidth + 1], p1[mGridWidth + 1], p2[mGridWidth + 1], p3[mGridWidth + 1]);
+
+            const __m128 upper = _mm_add_ps(_mm_add_ps(h00, _mm_mul_ps(tx, _mm_sub_ps(h11, h01))), _mm_mul_ps(tz, _mm_sub_ps(h01, h00)));
+            const __m128 lower = _mm_add_ps(_mm_add_ps(h00, _mm_mul_ps(tx, _mm_sub_ps(h10, h00))), _mm_mul_ps(tz, _mm_sub_ps(h11, h10)));
+            const __m128 isUpper = _mm_cmpge_ps(tz, tx);
+            const __m128 height = _mm_or_ps(_mm_and_ps(isUpper, upper), _mm_andnot_ps(isUpper, lower));
+            _mm_storeu_ps(heights.data() + i, _mm_and_ps(height, inside));
+        }
+    }
+#endif
+
+    //The rest, or everything without SSE2
+    for (; i < count; i++)
+        heights[i] = getHeightAt(QVector3D(positionsXZ[i].x(), 0.f, positionsXZ[i].y()));
 }
 
+namespace
+{
+//Rays per thread should be at least this many in the batch raycast()
+constexpr size_t kMinRaysPerThread{ 256 };
+
+//Narrows [tMin, tMax] to where origin + t * direction is in [low, high]. False if nothing is left
+bool clipToSlab(float origin, float direction, float low, float high, float& tMin, float& tMax)
+{
+    if (direction == 0.f)
+        return origin >= low && origin <= high;
+    float t0 = (low - origin) / direction;
+    float t1 = (high - origin) / direction;
+    if (t0 > t1)
+        std::swap(t0, t1);
+    tMin = std::max(tMin, t0);
+    tMax = std::min(tMax, t1);
+    return tMin <= tMax;
+}
+
+//Moller-Trumbore, from both sides. t is set if the ray hits the triangle
+bool rayHitsTriangle(const QVector3D& origin, const QVector3D& direction, const QVector3D& a, const QVector3D& b, const QVector3D& c, float& t)
+{
+    const QVector3D edge1 = b - a;
+    const QVector3D edge2 = c - a;
+    const QVector3D p = QVector3D::crossProduct(direction, edge2);
+    const float determinant = QVector3D::dotProduct(edge1, p);
+    if (std::fabs(determinant) < 1e-12f)
+        return false;
+    const float inverseDeterminant = 1.f / determinant;
+    const QVector3D s = origin - a;
+    const float u = QVector3D::dotProduct(s, p) * inverseDeterminant;
+    if (u < 0.f || u > 1.f)
+        return false;
+    const QVector3D q = QVector3D::crossProduct(s, edge1);
+    const float v = QVector3D::dotProduct(direction, q) * inverseDeterminant;
+    if (v < 0.f || u + v > 1.f)
+        return false;
+    t = QVector3D::dotProduct(edge2, q) * inverseDeterminant;
+    return true;
+}
+}
+
+//The ray in grid coordinates as well: u grows with w, v with d, one cell per unit. t is the same in both
+struct HeightMap::GridRay
+{
+    QVector3D origin;
+    QVector3D direction;
+    float maxDistance;
+    float u;
+    float v;
+    float directionU;
+    float directionV;
+};
+
+void HeightMap::buildMinMaxPyramid()
+{
+    mMinMaxPyramid.clear();
+    const int cellsW = mGridWidth - 1;
+    const int cellsD = mGridDepth - 1;
+    if (cellsW < 1 || cellsD < 1)
+        return;
+
+    //Level 0 from the heights - the squares share their edge samples
+    MinMaxLevel level;
+    level.width = (cellsW + kRayLeafQuads - 1) / kRayLeafQuads;
+    level.depth = (cellsD + kRayLeafQuads - 1) / kRayLeafQuads;
+    level.minHeights.resize(static_cast<size_t>(level.width) * level.depth);
+    level.maxHeights.resize(level.minHeights.size());
+    runInBands(static_cast<size_t>(level.depth), kMinRowsPerThread / kRayLeafQuads, [&](size_t bandFirst, size_t bandLast) {
+        for (int squareD = static_cast<int>(bandFirst); squareD < static_cast<int>(bandLast); squareD++)
+        {
+            const int firstD = squareD * kRayLeafQuads;
+            const int lastD = std::min(firstD + kRayLeafQuads, cellsD);
+            for (int squareW = 0; squareW < level.width; squareW++)
+            {
+                const int firstW = squareW * kRayLeafQuads;
+                const int lastW = std::min(firstW + kRayLeafQuads, cellsW);
+                float low = std::numeric_limits<float>::max();
+                float high = std::numeric_limits<float>::lowest();
+                for (int d = firstD; d <= lastD; d++)
+                {
+                    const float* row = mHeights.data() + static_cast<size_t>(d) * mGridWidth;
+                    const auto [rowLow, rowHigh] = std::minmax_element(row + firstW, row + lastW + 1);
+                    low = std::min(low, *rowLow);
+                    high = std::max(high, *rowHigh);
+                }
+                level.minHeights[squareW + static_cast<size_t>(squareD) * level.width] = low;
+                level.maxHeights[squareW + static_cast<size_t>(squareD) * level.width] = high;
+            }
+        }
+    });
+    mMinMaxPyramid.push_back(std::move(level));
+
+    //Each level up from the 2 x 2 squares below it
+    while (mMinMaxPyramid.back().width > 1 || mMinMaxPyramid.back().depth > 1)
+    {
+        const MinMaxLevel& below = mMinMaxPyramid.back();
+        MinMaxLevel up;
+        up.width = (below.width + 1) / 2;
+        up.depth = (below.depth + 1) / 2;
+        up.minHeights.resize(static_cast<size_t>(up.width) * up.depth);
+        up.maxHeights.resize(up.minHeights.size());
+        for (int d = 0; d < up.depth; d++)
+        {
+            for (int w = 0; w < up.width; w++)
+            {
+                float low = std::numeric_limits<float>::max();
+                float high = std::numeric_limits<float>::lowest();
+                for (int child = 0; child < 4; child++)
+                {
+                    const int childW = 2 * w + (child & 1);
+                    const int childD = 2 * d + (child >> 1);
+                    if (childW >= below.width || childD >= below.depth)
+                        continue;
+                    low = std::min(low, below.minHeights[childW + static_cast<size_t>(childD) * below.width]);
+                    high = std::max(high, below.maxHeights[childW + static_cast<size_t>(childD) * below.width]);
+                }
+                up.minHeights[w + static_cast<size_t>(d) * up.width] = low;
+                up.maxHeights[w + static_cast<size_t>(d) * up.width] = high;
+            }
+        }
+        mMinMaxPyramid.push_back(std::move(up));
+    }
+}
+
+TerrainRayHit HeightMap::raycast(const TerrainRay& ray) const
+{
+    TerrainRayHit hit;
+    if (mMinMaxPyramid.empty() || ray.direction.isNull() || !(ray.maxDistance >= 0.f))
+        return hit;
+
+    const GridRay gridRay{ ray.origin, ray.direction, ray.maxDistance,
+                           (ray.origin.x() - mOriginX) / mSpacing, (mOriginZ - ray.origin.z()) / mSpacing,
+                           ray.direction.x() / mSpacing, -ray.direction.z() / mSpacing };
+    raycastNode(gridRay, static_cast<int>(mMinMaxPyramid.size()) - 1, 0, 0, 0.f, ray.maxDistance, hit);
+    return hit;
+}
+
+void HeightMap::raycast(std::span<const TerrainRay> rays, std::span<TerrainRayHit> hits) const
+{
+    runInBands(std::min(rays.size(), hits.size()), kMinRaysPerThread, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++)
+            hits[i] = raycast(rays[i]);
+    });
+}
+
+//The ray is clipped to the square of the node. If what is left of it is all above or all below the heights in the square,
+//it can not hit anything there. Else the children are tried in the order the ray goes through them,
+//so the first hit found is the closest
+bool HeightMap::raycastNode(const GridRay& ray, int level, int nodeW, int nodeD, float tMin, float tMax, TerrainRayHit& hit) const
+{
+    const int cellsW = mGridWidth - 1;
+    const int cellsD = mGridDepth - 1;
+    const int size = kRayLeafQuads << level;
+    const int firstW = nodeW * size;
+    const int firstD = nodeD * size;
+    const int lastW = std::min(firstW + size, cellsW);
+    const int lastD = std::min(firstD + size, cellsD);
+    if (!clipToSlab(ray.u, ray.directionU, static_cast<float>(firstW), static_cast<float>(lastW), tMin, tMax) ||
+        !clipToSlab(ray.v, ray.directionV, static_cast<float>(firstD), static_cast<float>(lastD), tMin, tMax))
+        return false;
+
+    const MinMaxLevel& minMax = mMinMaxPyramid[level];
+    const size_t square = nodeW + static_cast<size_t>(nodeD) * minMax.width;
+    const float y0 = ray.origin.y() + ray.direction.y() * tMin;
+    const float y1 = ray.origin.y() + ray.direction.y() * tMax;
+    if (std::max(y0, y1) < minMax.minHeights[square] || std::min(y0, y1) > minMax.maxHeights[square])
+        return false;
+
+    if (level > 0)
+    {
+        //The children the ray goes through, sorted by where it enters them
+        std::pair<float, int> children[4];
+        int childCount{ 0 };
+        const MinMaxLevel& below = mMinMaxPyramid[level - 1];
+        const int childSize = size / 2;
+        for (int child = 0; child < 4; child++)
+        {
+            const int childW = 2 * nodeW + (child & 1);
+            const int childD = 2 * nodeD + (child >> 1);
+            if (childW >= below.width || childD >= below.depth)
+                continue;
+            float childMin = tMin;
+            float childMax = tMax;
+            if (clipToSlab(ray.u, ray.directionU, static_cast<float>(childW * childSize), static_cast<float>(std::min((childW + 1) * childSize, cellsW)), childMin, childMax) &&
+                clipToSlab(ray.v, ray.directionV, static_cast<float>(childD * childSize), static_cast<float>(std::min((childD + 1) * childSize, cellsD)), childMin, childMax))
+                children[childCount++] = { childMin, child };
+        }
+        std::sort(children, children + childCount);
+        for (int i = 0; i < childCount; i++)
+        {
+            const int child = children[i].second;
+            if (raycastNode(ray, level - 1, 2 * nodeW + (child & 1), 2 * nodeD + (child >> 1), tMin, tMax, hit))
+                return true;
+        }
+        return false;
+    }
+
+    //A leaf: the triangles of the cells the ray passes over, the closest hit wins
+    const float uStart = ray.u + ray.directionU * tMin;
+    const float uEnd = ray.u + ray.directionU * tMax;
+    const float vStart = ray.v + ray.directionV * tMin;
+    const float vEnd = ray.v + ray.directionV * tMax;
+    const int cellFirstW = std::clamp(static_cast<int>(std::floor(std::min(uStart, uEnd))), firstW, lastW - 1);
+    const int cellLastW = std::clamp(static_cast<int>(std::floor(std::max(uStart, uEnd))), firstW, lastW - 1);
+    const int cellFirstD = std::clamp(static_cast<int>(std::floor(std::min(vStart, vEnd))), firstD, lastD - 1);
+    const int cellLastD = std::clamp(static_cast<int>(std::floor(std::max(vStart, vEnd))), firstD, lastD - 1);
+    auto corner = [&](int w, int d) {
+        return QVector3D(mOriginX + w * mSpacing, mHeights[w + static_cast<size_t>(d) * mGridWidth], mOriginZ - d * mSpacing);
+    };
+    float closest = std::numeric_limits<float>::max();
+    for (int d = cellFirstD; d <= cellLastD; d++)
+    {
+        for (int w = cellFirstW; w <= cellLastW; w++)
+        {
+            //The same two triangles as in makeChunks()
+            const QVector3D corner00 = corner(w, d);
+            const QVector3D corner11 = corner(w + 1, d + 1);
+            float t{ 0.f };
+            if (rayHitsTriangle(ray.origin, ray.direction, corner00, corner11, corner(w, d + 1), t) && t >= 0.f && t <= ray.maxDistance)
+                closest = std::min(closest, t);
+            if (rayHitsTriangle(ray.origin, ray.direction, corner00, corner(w + 1, d), corner11, t) && t >= 0.f && t <= ray.maxDistance)
+                closest = std::min(closest, t);
+        }
+    }
+    if (closest == std::numeric_limits<float>::max())
+        return false;
+    hit.hit = true;
+    hit.distance = closest;
+    hit.position = ray.origin + ray.direction * closest;
+    return true;
+}
+
+void HeightMap::optimizeMesh()
+{
+    //The strips already go through the grid in order, and they can not be reordered as triangles
+    if (mMeshOptimized || mIndices.size() < 3 || mTriangleStrips)
+        return;
+
+    //Each chunk on its own, so the triangles stay inside the index range of their chunk
+    auto before = MeshOptimizer::analyzeVertexCache(mIndices.data(), mIndices.size(), mTerrainVertices.size());
+    for (const TerrainChunk& chunk : mChunks)
+        MeshOptimizer::optimizeVertexCache(mIndices.data() + chunk.firstIndex, chunk.indexCount, mTerrainVertices.size());
+    if (mChunks.empty())
+        MeshOptimizer::optimizeVertexCache(mIndices.data(), mIndices.size(), mTerrainVertices.size());
+    auto after = MeshOptimizer::analyzeVertexCache(mIndices.data(), mIndices.size(), mTerrainVertices.size());
+    mMeshOptimized = true;
+
+    qDebug() << mName.c_str() << "vertex cache optimized - ACMR" << before.acmr << "->" << after.acmr
+             << " ATVR" << before.atvr << "->" << after.atvr;
+}
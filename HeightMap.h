@@ -3,21 +3,245 @@
 
 #include "VisualObject.h"
 #include <string>
+#include <span>
+#include <cstdint>
+#include <limits>
+
+class Frustum;
+class FractalNoise;
+
+//A square piece of the terrain: its range in the index buffer, and its bounding box
+struct TerrainChunk
+{
+    uint32_t firstIndex{ 0 };
+    uint32_t indexCount{ 0 };
+    QVector3D boundsMin{};
+    QVector3D boundsMax{};
+};
+
+//A node in the level of detail quadtree of the displaced terrain. The level 0 nodes are the chunks, and each level up
+//covers twice the size. All levels are drawn with the same patch of kChunkQuads x kChunkQuads quads,
+//with (1 << level) samples between its vertices
+struct TerrainLodNode
+{
+    int startW{ 0 };                        //first sample
+    int startD{ 0 };
+    int level{ 0 };
+    int children[4]{ -1, -1, -1, -1 };      //nodes a level down, -1 if outside the grid. Quadrant q is at (q & 1, q >> 1)
+    QVector3D boundsMin{};
+    QVector3D boundsMax{};
+};
+
+//A node to draw, from HeightMap::selectLod(). quadrants is a mask of the quadrants to draw - 0xf for the whole node.
+//The vertices blend into the next level between morphStart and morphEnd meters from the camera
+struct TerrainLodSelection
+{
+    uint32_t node{ 0 };
+    uint32_t quadrants{ 0 };
+    float morphStart{ 0.f };
+    float morphEnd{ 0.f };
+};
+
+//Where a grid of height samples is put in the world
+struct TerrainPlacement
+{
+    float originX{ 0.f };       //x and z of the first sample - x grows along a row, z shrinks from row to row
+    float originZ{ 0.f };
+    float spacing{ 1.f };       //meters between the samples
+    float heightScale{ 1.f };   //height = sample * heightScale + heightOffset
+    float heightOffset{ 0.f };
+};
+
+//A ray for HeightMap::raycast(), in the coordinates of the terrain. Hits are looked for between the origin
+//and maxDistance lengths of direction
+struct TerrainRay
+{
+    QVector3D origin{};
+    QVector3D direction{};
+    float maxDistance{ std::numeric_limits<float>::max() };
+};
+
+struct TerrainRayHit
+{
+    bool hit{ false };
+    float distance{ 0.f };      //in lengths of direction - meters if it is normalized
+    QVector3D position{};
+};
+
+//Vertex of the terrain mesh, 4 bytes instead of the 32 of a Vertex. x and z are not stored - the vertices are in
+//row-major grid order, so terrainmesh.vert finds them from the vertex index. The normal is x and z of the unit normal
+//times 127, y is found from them as it always points up
+struct TerrainVertex
+{
+    uint16_t height{ 0 };   //the sample - height = sample * heightScale + heightOffset
+    int8_t normalX{ 0 };
+    int8_t normalZ{ 0 };
+};
+static_assert(sizeof(TerrainVertex) == 4, "Must match the vertex input of terrainmesh.vert");
 
 class HeightMap : public VisualObject
 {
 public:
     HeightMap();
 
+    //Reads one channel only. 16 bit images (ie. 16 bit PNG) keep all 16 bits, and a .r16 file is read as raw
+    //little-endian 16 bit samples of a square heightmap. 8 bit images are read as grey
     void makeTerrain(std::string heightMapImage);
 
+    //The R value of RGBA pixels
     void makeTerrain(unsigned char* textureData, int width, int height);
+
+    //A terrain from one byte per sample (row-major) put where placement says - ie. one tile of a PagedTerrain
+    void makeTerrain(const unsigned char* samples, int width, int depth, const TerrainPlacement& placement);
+    //The same with 16 bit samples
+    void makeTerrain(const uint16_t* samples, int width, int depth, const TerrainPlacement& placement);
+
+    //Terrain for big heightmaps: no vertices or indices are made. Renderer uploads getHeightSamples() as an R8 or R16 texture,
+    //and draws one shared flat patch of kChunkQuads x kChunkQuads quads per node from selectLod(), lifted by terrain.vert.
+    //The CPU keeps 6 bytes per sample (the float height and the sample), a full mesh needs about 60
+    void makeDisplacedTerrain(std::string heightMapImage);
+    void makeDisplacedTerrain(unsigned char* textureData, int width, int height);
+
+    //Terrains of any size from 16 bit samples of FractalNoise, placed as a heightmap file would be.
+    //The same noise settings always give the same terrain
+    void makeNoiseTerrain(int width, int depth, const FractalNoise& noise);
+    void makeDisplacedNoiseTerrain(int width, int depth, const FractalNoise& noise);
+
+    //Height of the terrain surface under positionXZ (y is not used). 0 outside the terrain.
+    //Finds the grid cell and its triangle directly from x and z, so the cost does not depend on the terrain size
     float getHeightAt(const QVector3D& positionXZ) const;
 
+    //getHeightAt() for many positions at once, with the same results. positionsXZ holds (x, z) pairs,
+    //heights must be at least as long. Runs 8 positions at a time with AVX2 gathers when the build has AVX2,
+    //else 4 at a time with SSE2
+    void getHeightsAt(std::span<const QVector2D> positionsXZ, std::span<float> heights) const;
+
+    //The first point where the ray hits the terrain surface - the same two triangles per cell as the mesh, from either side.
+    //Only the parts of the terrain the ray comes close to are looked at: it goes down a min/max pyramid of the heights,
+    //skipping the squares it passes above or below, and tests the triangles in the few cells left. For mouse picking
+    //and line of sight. The pyramid is made with the chunks, so heights changed later are not seen
+    TerrainRayHit raycast(const TerrainRay& ray) const;
+    //raycast() for many rays, spread over threads when there are many. hits must be at least as long as rays
+    void raycast(std::span<const TerrainRay> rays, std::span<TerrainRayHit> hits) const;
+    //Cells along each side of the smallest squares of the min/max pyramid
+    static constexpr int kRayLeafQuads{ 4 };
+
+    //The mesh made by makeTerrain() - there are no Vertex in getVertices(). Renderer draws it with terrainmesh.vert
+    inline const std::vector<TerrainVertex>& getTerrainVertices() const { return mTerrainVertices; }
+
+    //Normals from central differences of the heights, written into the vertices.
+    //The rows are split in bands between threads, and each row is done 4 or 8 vertices at a time.
+    //The second version only recomputes the vertices in [firstW, lastW) x [firstD, lastD) - for when some heights have changed.
+    //Called by makeTerrain(). Changed normals must be uploaded again to be seen
+    void calculateHeighMapNormals();
+    void calculateHeighMapNormals(int firstW, int firstD, int lastW, int lastD);
+
+    //Only the triangles are reordered, and only within their chunk - the vertices stay in row-major grid order,
+    //which already is close to the best fetch order, and keeps each sample at index w + d * width. Nothing is done for triangle strips
+    void optimizeMesh() override;
+
+    //One level of detail for the whole terrain makes no sense, we are standing on it
+    void generateLods() override {}
+    //The chunks are culled instead of meshlets
+    void buildMeshlets() override {}
+
+    //The terrain mesh as triangle strips with primitive restart, about 2 indices per quad instead of the 6 of a triangle list.
+    //On by default - set it before makeTerrain(). Renderer draws the strips with a triangle strip pipeline
+    inline void setTriangleStrips(bool triangleStrips) { mTriangleStrips = triangleStrips; }
+    inline bool usesTriangleStrips() const { return mTriangleStrips; }
+    static constexpr uint32_t kPrimitiveRestart{ 0xFFFFFFFF };
+
+    //Chunks of kChunkQuads x kChunkQuads quads, in index buffer order. Renderer draws the ones inside the frustum
+    inline const std::vector<TerrainChunk>& getChunks() const { return mChunks; }
+    static constexpr int kChunkQuads{ 64 };
+
+    //For the displaced terrain. Height in meters is sample * getHeightScale() + getHeightOffset()
+    inline bool isDisplaced() const { return mDisplaced; }
+    //The samples as read, 8 or 16 bits of getSampleBits() in each
+    inline const std::vector<uint16_t>& getHeightSamples() const { return mHeightSamples; }
+    inline int getSampleBits() const { return mSampleBits; }
+    inline float getHeightScale() const { return mHeightScale; }
+    inline float getHeightOffset() const { return mHeightOffset; }
+    inline int getGridWidth() const { return mGridWidth; }
+    inline int getGridDepth() const { return mGridDepth; }
+    inline float getSpacing() const { return mSpacing; }
+    inline float getOriginX() const { return mOriginX; }
+    inline float getOriginZ() const { return mOriginZ; }
+
+    //Continuous level of detail for the displaced terrain (CDLOD). Nodes closer to the camera than getLodRange(level - 1)
+    //are split into their children, so the level grows with the distance, and each level has about the same number
+    //of triangles on screen. Nodes outside the frustum are skipped. cameraPosition is in the coordinates of the terrain.
+    //Close to the end of its range a vertex is moved onto the triangles of the next level (see terrain.vert),
+    //so where two levels meet they have the same edges and there are no cracks
+    void selectLod(const QVector3D& cameraPosition, const Frustum& frustum, std::vector<TerrainLodSelection>& selection) const;
+    inline const std::vector<TerrainLodNode>& getLodNodes() const { return mLodNodes; }
+    inline float getLodRange(int level) const { return kLodRangeFactor * kChunkQuads * mSpacing * static_cast<float>(1 << level); }
+    //The range is this many node sizes - big enough that levels next to each other never differ by more than one
+    static constexpr float kLodRangeFactor{ 3.f };
+    //Part of the range where the vertices morph into the next level
+    static constexpr float kLodMorphStart{ 0.85f };
+
+    //The height texture of the displaced terrain, made and destroyed by Renderer
+    TextureHandle mHeightTextureHandle;
+
 private:
 	int mWidth{ 0 };
 	int mHeight{ 0 };
 	int mChannels{ 0 };
+
+    //The grid as made by makeTerrain(), for getHeightAt()
+    std::vector<float> mHeights;    //one per vertex, row-major: mHeights[w + d * mGridWidth]
+    int mGridWidth{ 0 };            //vertices along x
+    int mGridDepth{ 0 };            //vertices along z
+    float mSpacing{ 1.f };          //meters between vertices in x and z
+    float mOriginX{ 0.f };          //x of the first vertex - x grows with w
+    float mOriginZ{ 0.f };          //z of the first vertex - z shrinks with d
+    float mHeightScale{ 1.f };      //meters per step in the heightmap
+    float mHeightOffset{ 0.f };     //height of sample 0
+
+    bool mDisplaced{ false };
+    std::vector<uint16_t> mHeightSamples;   //the samples as read, only kept for the displaced terrain
+    int mSampleBits{ 8 };
+    std::vector<TerrainVertex> mTerrainVertices;
+    bool mTriangleStrips{ true };
+
+    //Where a heightmap read from a file, or given as RGBA, is put: in the middle of the world, with the same
+    //height range for 8 and 16 bit samples
+    static TerrainPlacement defaultPlacement(int width, int depth, int sampleBits);
+    //Reads the samples from a file into mHeightSamples, see makeTerrain(std::string)
+    bool loadHeightMapFile(const std::string& heightMapImage);
+    //Reads every sampleStride sample into mHeights and mHeightSamples, and sets up the grid
+    template <typename Sample>
+    void readHeights(const Sample* samples, size_t sampleStride, int width, int depth, const TerrainPlacement& placement);
+    //The vertices from mHeightSamples, the chunks and the normals
+    void makeMesh();
+    //Drops the mesh and makes the chunks for the displaced terrain
+    void makeDisplaced();
+    //Makes mChunks from mHeights, and their triangles in mIndices if withIndices
+    void makeChunks(bool withIndices);
+
+    //The chunks first, then each level up - the root is the last one
+    std::vector<TerrainLodNode> mLodNodes;
+    void buildLodTree();
+    void selectLodNode(int index, const QVector3D& cameraPosition, const Frustum& frustum, std::vector<TerrainLodSelection>& selection) const;
+
+    void calculateNormalsInRow(int d, int firstW, int lastW);
+
+    //The lowest and highest height in squares of cells - kRayLeafQuads cells along each side in level 0,
+    //twice that each level up, and the last level is one square over the whole terrain
+    struct MinMaxLevel
+    {
+        int width{ 0 };     //squares along x
+        int depth{ 0 };     //squares along z
+        std::vector<float> minHeights;
+        std::vector<float> maxHeights;
+    };
+    std::vector<MinMaxLevel> mMinMaxPyramid;
+    void buildMinMaxPyramid();
+    struct GridRay;     //the ray for raycastNode(), defined in HeightMap.cpp
+    bool raycastNode(const GridRay& ray, int level, int nodeW, int nodeD, float tMin, float tMax, TerrainRayHit& hit) const;
+
+    std::vector<TerrainChunk> mChunks;
 };
 
 #endif // HEIGHTMAP_H
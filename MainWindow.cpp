@@ -12,7 +12,6 @@
 #include <QInputDialog>
 #include "VulkanWindow.h"
 #include "Renderer.h"
-#include "TriangleSurface.h"
 
 MainWindow::MainWindow(VulkanWindow *vw, QPlainTextEdit *logWidget)
     : mVulkanWindow(vw)
@@ -106,11 +105,9 @@ void MainWindow::openFile() // slot
     auto filnavn = QFileDialog::getOpenFileName(this);
     if (!filnavn.isEmpty())
     {
-        TriangleSurface* surf = new TriangleSurface(filnavn.toStdString());
+        //The file is read on a worker thread, and only the new object gets uploaded to the GPU
         auto rw = dynamic_cast<Renderer*>(mVulkanWindow->getRenderWindow());
-        rw->getObjects().push_back(surf);
-        rw->releaseResources();
-        rw->initResources();
+        rw->importObjectAsync(filnavn.toStdString());
     }
 }
 
@@ -0,0 +1,258 @@
+#include "MeshCodec.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+constexpr float kQuantizationSteps{ 65535.f };
+constexpr float kOctahedralScale{ 32767.f };
+//Never made for a unit normal, as the components are clamped to +-32767 - marks a zero normal in a mesh with normals
+constexpr int16_t kZeroNormal{ -32768 };
+
+//Start of the encoded data, before the compression
+struct QuantizationHeader
+{
+    float positionMin[3];
+    float positionStep[3];  //(max - min) / kQuantizationSteps, 0 if the mesh is flat along the axis
+    float uvMin[2];
+    float uvStep[2];
+    uint32_t hasNormals;    //0 if all normals are zero - they are not stored then
+};
+
+//Differences between 16 bit values, stored so small negative and positive differences both get small codes
+inline uint16_t deltaCode(uint16_t value, uint16_t previous)
+{
+    const uint16_t delta = static_cast<uint16_t>(value - previous);
+    return static_cast<uint16_t>((delta << 1) ^ -(delta >> 15));
+}
+
+inline uint16_t deltaDecode(uint16_t code, uint16_t previous)
+{
+    return static_cast<uint16_t>(previous + static_cast<uint16_t>((code >> 1) ^ -(code & 1)));
+}
+
+inline uint16_t quantize(float value, float min, float step)
+{
+    return step > 0.f ? static_cast<uint16_t>(std::clamp(std::lround((value - min) / step), 0L, 65535L)) : 0;
+}
+
+//Octahedral encoding: the unit sphere folded out to a square
+void octahedralEncode(float x, float y, float z, int16_t& encodedX, int16_t& encodedY)
+{
+    const float length = std::abs(x) + std::abs(y) + std::abs(z);
+    if (length == 0.f)
+    {
+        encodedX = kZeroNormal;
+        encodedY = 0;
+        return;
+    }
+    x /= length;
+    y /= length;
+    if (z < 0.f)    //lower half folded over the diagonals
+    {
+        const float foldedX = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+        const float foldedY = (1.f - std::abs(x)) * (y >= 0.f ? 1.f : -1.f);
+        x = foldedX;
+        y = foldedY;
+    }
+    encodedX = static_cast<int16_t>(std::lround(std::clamp(x, -1.f, 1.f) * kOctahedralScale));
+    encodedY = static_cast<int16_t>(std::lround(std::clamp(y, -1.f, 1.f) * kOctahedralScale));
+}
+
+void octahedralDecode(int16_t encodedX, int16_t encodedY, float& x, float& y, float& z)
+{
+    if (encodedX == kZeroNormal)
+    {
+        x = y = z = 0.f;
+        return;
+    }
+    x = std::max(encodedX / kOctahedralScale, -1.f);
+    y = std::max(encodedY / kOctahedralScale, -1.f);
+    z = 1.f - std::abs(x) - std::abs(y);
+    const float fold = std::max(-z, 0.f);
+    x += x >= 0.f ? -fold : fold;
+    y += y >= 0.f ? -fold : fold;
+    const float inverseLength = 1.f / std::sqrt(x * x + y * y + z * z);
+    x *= inverseLength;
+    y *= inverseLength;
+    z *= inverseLength;
+}
+
+//Writes the delta codes of the values as two byte planes: all the low bytes, then all the high bytes.
+//The high bytes are mostly 0 or 255, which the compression handles much better when they are next to each other
+template <typename Value>
+void writePlanes(QByteArray& out, size_t count, Value value)
+{
+    const qsizetype start = out.size();
+    out.resize(start + 2 * count);
+    char* low = out.data() + start;
+    char* high = low + count;
+    uint16_t previous{ 0 };
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint16_t current = value(i);
+        const uint16_t code = deltaCode(current, previous);
+        previous = current;
+        low[i] = static_cast<char>(code & 0xff);
+        high[i] = static_cast<char>(code >> 8);
+    }
+}
+
+template <typename Store>
+bool readPlanes(const uchar*& cursor, const uchar* end, size_t count, Store store)
+{
+    if (static_cast<size_t>(end - cursor) < 2 * count)
+        return false;
+    const uchar* low = cursor;
+    const uchar* high = low + count;
+    uint16_t previous{ 0 };
+    for (size_t i = 0; i < count; i++)
+    {
+        previous = deltaDecode(static_cast<uint16_t>(low[i] | (high[i] << 8)), previous);
+        store(i, previous);
+    }
+    cursor += 2 * count;
+    return true;
+}
+}
+
+QByteArray MeshCodec::encode(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, int compressionLevel)
+{
+    const size_t vertexCount = vertices.size();
+
+    QuantizationHeader header{};
+    if (vertexCount > 0)
+    {
+        float positionMax[3] = { vertices[0].x, vertices[0].y, vertices[0].z };
+        float uvMax[2] = { vertices[0].u, vertices[0].v };
+        std::copy(positionMax, positionMax + 3, header.positionMin);
+        std::copy(uvMax, uvMax + 2, header.uvMin);
+        for (const Vertex& vertex : vertices)
+        {
+            const float position[3] = { vertex.x, vertex.y, vertex.z };
+            const float uv[2] = { vertex.u, vertex.v };
+            for (int i = 0; i < 3; i++)
+            {
+                header.positionMin[i] = std::min(header.positionMin[i], position[i]);
+                positionMax[i] = std::max(positionMax[i], position[i]);
+            }
+            for (int i = 0; i < 2; i++)
+            {
+                header.uvMin[i] = std::min(header.uvMin[i], uv[i]);
+                uvMax[i] = std::max(uvMax[i], uv[i]);
+            }
+            if (vertex.r != 0.f || vertex.g != 0.f || vertex.b != 0.f)
+                header.hasNormals = 1;
+        }
+        for (int i = 0; i < 3; i++)
+            header.positionStep[i] = (positionMax[i] - header.positionMin[i]) / kQuantizationSteps;
+        for (int i = 0; i < 2; i++)
+            header.uvStep[i] = (uvMax[i] - header.uvMin[i]) / kQuantizationSteps;
+    }
+
+    QByteArray raw;
+    raw.reserve(sizeof(header) + vertexCount * 14 + indices.size() * 2);
+    raw.append(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    writePlanes(raw, vertexCount, [&](size_t i) { return quantize(vertices[i].x, header.positionMin[0], header.positionStep[0]); });
+    writePlanes(raw, vertexCount, [&](size_t i) { return quantize(vertices[i].y, header.positionMin[1], header.positionStep[1]); });
+    writePlanes(raw, vertexCount, [&](size_t i) { return quantize(vertices[i].z, header.positionMin[2], header.positionStep[2]); });
+    if (header.hasNormals)
+    {
+        std::vector<int16_t> normals(2 * vertexCount);
+        for (size_t i = 0; i < vertexCount; i++)
+            octahedralEncode(vertices[i].r, vertices[i].g, vertices[i].b, normals[2 * i], normals[2 * i + 1]);
+        writePlanes(raw, vertexCount, [&](size_t i) { return static_cast<uint16_t>(normals[2 * i]); });
+        writePlanes(raw, vertexCount, [&](size_t i) { return static_cast<uint16_t>(normals[2 * i + 1]); });
+    }
+    writePlanes(raw, vertexCount, [&](size_t i) { return quantize(vertices[i].u, header.uvMin[0], header.uvStep[0]); });
+    writePlanes(raw, vertexCount, [&](size_t i) { return quantize(vertices[i].v, header.uvMin[1], header.uvStep[1]); });
+
+    //Indices as the difference from the index before, in 7 bit groups - most take one byte after MeshOptimizer
+    uint32_t previous{ 0 };
+    for (uint32_t index : indices)
+    {
+        const int64_t delta = static_cast<int64_t>(index) - previous;
+        uint64_t code = static_cast<uint64_t>((delta << 1) ^ (delta >> 63));
+        previous = index;
+        while (code >= 0x80)
+        {
+            raw.append(static_cast<char>((code & 0x7f) | 0x80));
+            code >>= 7;
+        }
+        raw.append(static_cast<char>(code));
+    }
+
+    return qCompress(raw, compressionLevel);
+}
+
+bool MeshCodec::canHold(const uchar* data, size_t size, size_t vertexCount, size_t indexCount)
+{
+    if (size < 4)
+        return false;
+    //qCompress starts with the uncompressed size, big endian
+    const size_t rawSize = (static_cast<size_t>(data[0]) << 24) | (static_cast<size_t>(data[1]) << 16) |
+                           (static_cast<size_t>(data[2]) << 8) | data[3];
+    //At least the positions and uvs (5 values of 2 bytes) for each vertex, and one byte for each index
+    const uint64_t smallestRawSize = sizeof(QuantizationHeader) + uint64_t{ vertexCount } * 10 + indexCount;
+    //and deflate never shrinks data to less than about 1/1032 of its size, so a damaged rawSize is caught too
+    return smallestRawSize <= rawSize && rawSize <= uint64_t{ size } * 1032;
+}
+
+bool MeshCodec::decode(const uchar* data, size_t size, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+{
+    const QByteArray raw = qUncompress(data, static_cast<qsizetype>(size));
+    const size_t vertexCount = vertices.size();
+    if (raw.size() < static_cast<qsizetype>(sizeof(QuantizationHeader)))
+        return false;
+
+    QuantizationHeader header;
+    memcpy(&header, raw.constData(), sizeof(header));
+    const uchar* cursor = reinterpret_cast<const uchar*>(raw.constData()) + sizeof(header);
+    const uchar* end = reinterpret_cast<const uchar*>(raw.constData()) + raw.size();
+
+    Vertex* out = vertices.data();
+    bool ok = readPlanes(cursor, end, vertexCount, [&](size_t i, uint16_t q) { out[i].x = header.positionMin[0] + q * header.positionStep[0]; }) &&
+              readPlanes(cursor, end, vertexCount, [&](size_t i, uint16_t q) { out[i].y = header.positionMin[1] + q * header.positionStep[1]; }) &&
+              readPlanes(cursor, end, vertexCount, [&](size_t i, uint16_t q) { out[i].z = header.positionMin[2] + q * header.positionStep[2]; });
+    if (ok && header.hasNormals)
+    {
+        //x is kept in r until y is read
+        ok = readPlanes(cursor, end, vertexCount, [&](size_t i, uint16_t q) { out[i].r = static_cast<int16_t>(q); }) &&
+             readPlanes(cursor, end, vertexCount, [&](size_t i, uint16_t q) {
+                 octahedralDecode(static_cast<int16_t>(out[i].r), static_cast<int16_t>(q), out[i].r, out[i].g, out[i].b);
+             });
+    }
+    else if (ok)
+    {
+        for (size_t i = 0; i < vertexCount; i++)
+            out[i].r = out[i].g = out[i].b = 0.f;
+    }
+    ok = ok &&
+         readPlanes(cursor, end, vertexCount, [&](size_t i, uint16_t q) { out[i].u = header.uvMin[0] + q * header.uvStep[0]; }) &&
+         readPlanes(cursor, end, vertexCount, [&](size_t i, uint16_t q) { out[i].v = header.uvMin[1] + q * header.uvStep[1]; });
+    if (!ok)
+        return false;
+
+    uint32_t previous{ 0 };
+    for (uint32_t& index : indices)
+    {
+        uint64_t code{ 0 };
+        for (int shift = 0; ; shift += 7)
+        {
+            if (cursor >= end || shift > 35)
+                return false;
+            const uchar byte = *cursor++;
+            code |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                break;
+        }
+        const int64_t delta = static_cast<int64_t>(code >> 1) ^ -static_cast<int64_t>(code & 1);
+        previous = static_cast<uint32_t>(previous + delta);
+        if (previous >= vertexCount)
+            return false;
+        index = previous;
+    }
+    return cursor == end;
+}
@@ -0,0 +1,31 @@
+#ifndef MESHCODEC_H
+#define MESHCODEC_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <QByteArray>
+#include "Vertex.h"
+
+//Compact encoding of an indexed mesh, used for the .meshcache files.
+//Indices are stored losslessly. The vertex attributes are quantized:
+// positions to 16 bit per axis inside the bounding box - error about (max - min) / 131070 per axis
+// uvs the same way inside the uv bounding box
+// normals with octahedral encoding, 16 bit per component - within 0.05 degrees, and always unit length after decoding.
+// Zero normals stay zero
+//Each value is stored as the difference from the one before, split in byte planes, and then compressed with qCompress
+namespace MeshCodec
+{
+    //Encodes the mesh. The indices are best ordered by MeshOptimizer first - that makes the differences small
+    QByteArray encode(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, int compressionLevel = 6);
+
+    //True if data made by encode() is big enough to hold that many vertices and indices, read from the size qCompress
+    //stores in front of the data. Checked before sizing the vectors for decode(), so damaged counts can't ask for more memory
+    bool canHold(const uchar* data, size_t size, size_t vertexCount, size_t indexCount);
+
+    //Decodes data made by encode(). vertices and indices must already have the sizes that were encoded.
+    //Fails if the data does not match those sizes, or an index is not below vertices.size()
+    bool decode(const uchar* data, size_t size, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+}
+
+#endif // MESHCODEC_H
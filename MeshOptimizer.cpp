@@ -0,0 +1,486 @@
+#include "MeshOptimizer.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <unordered_map>
+
+namespace
+{
+//Constants from Forsyth's article
+constexpr int kCacheSize{ 32 };             //size of the simulated LRU cache used for scoring
+constexpr float kLastTriangleScore{ 0.75f };
+constexpr float kCacheDecayPower{ 1.5f };
+constexpr float kValenceBoostScale{ 2.0f };
+constexpr float kValenceBoostPower{ 0.5f };
+
+//How much we want to draw a triangle using this vertex next:
+//high when the vertex is in the cache, and when few triangles are left to use it
+float vertexScore(int cachePosition, uint32_t remainingTriangles)
+{
+    if (remainingTriangles == 0)
+        return -1.f;    //no triangles left, will never be picked
+
+    float score{ 0.f };
+    if (cachePosition >= 0)
+    {
+        if (cachePosition < 3)  //used by the last triangle - fixed score to not favor one of them
+            score = kLastTriangleScore;
+        else
+            score = std::pow(1.f - (cachePosition - 3) / static_cast<float>(kCacheSize - 3), kCacheDecayPower);
+    }
+    //Vertices with few triangles left gets a boost, to not leave lonely triangles behind
+    score += kValenceBoostScale * std::pow(static_cast<float>(remainingTriangles), -kValenceBoostPower);
+    return score;
+}
+
+//Symmetric 4x4 matrix summing the squared distance to a set of planes (Garland & Heckbert).
+//weight is the summed triangle area, so the error can be given as an average squared distance
+struct Quadric
+{
+    double a2{}, b2{}, c2{}, d2{}, ab{}, ac{}, ad{}, bc{}, bd{}, cd{};
+    double weight{};
+
+    void addPlane(double a, double b, double c, double d, double w)
+    {
+        a2 += w * a * a; b2 += w * b * b; c2 += w * c * c; d2 += w * d * d;
+        ab += w * a * b; ac += w * a * c; ad += w * a * d;
+        bc += w * b * c; bd += w * b * d; cd += w * c * d;
+        weight += w;
+    }
+
+    Quadric& operator+=(const Quadric& o)
+    {
+        a2 += o.a2; b2 += o.b2; c2 += o.c2; d2 += o.d2;
+        ab += o.ab; ac += o.ac; ad += o.ad;
+        bc += o.bc; bd += o.bd; cd += o.cd;
+        weight += o.weight;
+        return *this;
+    }
+
+    //Weighted sum of squared distances from (x, y, z) to the planes
+    double evaluate(double x, double y, double z) const
+    {
+        return a2 * x * x + b2 * y * y + c2 * z * z + d2 +
+               2.0 * (ab * x * y + ac * x * z + bc * y * z + ad * x + bd * y + cd * z);
+    }
+};
+
+//Normal (not normalized) of the triangle p0 p1 p2
+QVector3D triangleNormal(const Vertex& p0, const Vertex& p1, const Vertex& p2)
+{
+    QVector3D e1(p1.x - p0.x, p1.y - p0.y, p1.z - p0.z);
+    QVector3D e2(p2.x - p0.x, p2.y - p0.y, p2.z - p0.z);
+    return QVector3D::crossProduct(e1, e2);
+}
+}
+
+MeshOptimizer::VertexCacheStats MeshOptimizer::analyzeVertexCache(const uint32_t* indices, size_t indexCount,
+                                                                  size_t vertexCount, unsigned cacheSize)
+{
+    VertexCacheStats stats{};
+    if (indexCount < 3 || vertexCount == 0)
+        return stats;
+
+    //FIFO cache: for each vertex, the miss number when it entered the cache (1-based)
+    std::vector<size_t> cacheTime(vertexCount, 0);
+    size_t misses{ 0 };
+    std::vector<char> used(vertexCount, 0);
+    size_t usedCount{ 0 };
+
+    for (size_t i = 0; i < indexCount; i++)
+    {
+        const uint32_t index = indices[i];
+        //In the cache if it entered it less than cacheSize misses ago (0 means it never did)
+        if (cacheTime[index] == 0 || misses - cacheTime[index] >= cacheSize)
+        {
+            ++misses;
+            cacheTime[index] = misses;
+        }
+        if (!used[index])
+        {
+            used[index] = 1;
+            ++usedCount;
+        }
+    }
+
+    stats.acmr = misses / static_cast<float>(indexCount / 3);
+    stats.atvr = misses / static_cast<float>(usedCount);
+    return stats;
+}
+
+void MeshOptimizer::optimizeVertexCache(uint32_t* indices, size_t indexCount, size_t vertexCount)
+{
+    const size_t triangleCount = indexCount / 3;
+    if (triangleCount == 0 || vertexCount == 0)
+        return;
+
+    //Triangles using each vertex, packed after each other: adjacency[triangleStart[v], triangleStart[v] + remaining[v])
+    std::vector<uint32_t> triangleStart(vertexCount + 1, 0);
+    for (size_t i = 0; i < triangleCount * 3; i++)
+        ++triangleStart[indices[i] + 1];
+    for (size_t v = 0; v < vertexCount; v++)
+        triangleStart[v + 1] += triangleStart[v];
+
+    std::vector<uint32_t> remaining(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++)
+        remaining[v] = triangleStart[v + 1] - triangleStart[v];
+
+    std::vector<uint32_t> adjacency(triangleCount * 3);
+    {
+        std::vector<uint32_t> fill(triangleStart.begin(), triangleStart.end() - 1);
+        for (size_t t = 0; t < triangleCount; t++)
+            for (int k = 0; k < 3; k++)
+                adjacency[fill[indices[t * 3 + k]]++] = static_cast<uint32_t>(t);
+    }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> scoreOfVertex(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++)
+        scoreOfVertex[v] = vertexScore(-1, remaining[v]);
+
+    std::vector<float> scoreOfTriangle(triangleCount);
+    std::vector<char> emitted(triangleCount, 0);
+    size_t bestTriangle{ 0 };
+    for (size_t t = 0; t < triangleCount; t++)
+    {
+        scoreOfTriangle[t] = scoreOfVertex[indices[t * 3]] + scoreOfVertex[indices[t * 3 + 1]] + scoreOfVertex[indices[t * 3 + 2]];
+        if (scoreOfTriangle[t] > scoreOfTriangle[bestTriangle])
+            bestTriangle = t;
+    }
+
+    std::vector<uint32_t> output;
+    output.reserve(triangleCount * 3);
+    std::vector<uint32_t> cache;
+    std::vector<uint32_t> newCache;
+    cache.reserve(kCacheSize + 3);
+    newCache.reserve(kCacheSize + 3);
+    size_t scanPosition{ 0 };     //when nothing in the cache has triangles left, continue from here
+
+    while (output.size() < triangleCount * 3)
+    {
+        const uint32_t* triangle = indices + bestTriangle * 3;
+        output.insert(output.end(), triangle, triangle + 3);
+        emitted[bestTriangle] = 1;
+
+        //Removing the triangle from the lists of its vertices
+        for (int k = 0; k < 3; k++)
+        {
+            const uint32_t v = triangle[k];
+            uint32_t* first = adjacency.data() + triangleStart[v];
+            uint32_t* last = first + remaining[v];
+            uint32_t* found = std::find(first, last, static_cast<uint32_t>(bestTriangle));
+            if (found != last)
+            {
+                std::swap(*found, *(last - 1));
+                --remaining[v];
+            }
+        }
+
+        //New LRU cache: the three vertices just used first, then the old content
+        newCache.assign(triangle, triangle + 3);
+        for (uint32_t v : cache)
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+                newCache.push_back(v);
+
+        //Update the scores of all vertices that were touched - also the ones falling out of the cache
+        for (size_t i = 0; i < newCache.size(); i++)
+        {
+            const uint32_t v = newCache[i];
+            cachePosition[v] = i < kCacheSize ? static_cast<int>(i) : -1;
+            scoreOfVertex[v] = vertexScore(cachePosition[v], remaining[v]);
+        }
+        if (newCache.size() > kCacheSize)
+            newCache.resize(kCacheSize);
+        std::swap(cache, newCache);
+
+        //Find the best triangle among the ones using a cached vertex
+        float bestScore{ -1.f };
+        for (uint32_t v : cache)
+        {
+            for (uint32_t a = triangleStart[v]; a < triangleStart[v] + remaining[v]; a++)
+            {
+                const uint32_t t = adjacency[a];
+                scoreOfTriangle[t] = scoreOfVertex[indices[t * 3]] + scoreOfVertex[indices[t * 3 + 1]] + scoreOfVertex[indices[t * 3 + 2]];
+                if (scoreOfTriangle[t] > bestScore)
+                {
+                    bestScore = scoreOfTriangle[t];
+                    bestTriangle = t;
+                }
+            }
+        }
+
+        //Nothing connected to the cache - start over at the next triangle not drawn yet
+        if (bestScore < 0.f)
+        {
+            while (scanPosition < triangleCount && emitted[scanPosition])
+                ++scanPosition;
+            bestTriangle = scanPosition;
+            if (scanPosition >= triangleCount)
+                break;
+        }
+    }
+
+    std::copy(output.begin(), output.end(), indices);
+}
+
+std::vector<uint32_t> MeshOptimizer::optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+{
+    constexpr uint32_t kUnused{ ~0u };
+    std::vector<uint32_t> remap(vertices.size(), kUnused);
+
+    //Number the vertices in the order they are first used
+    uint32_t nextVertex{ 0 };
+    for (uint32_t& index : indices)
+    {
+        if (remap[index] == kUnused)
+            remap[index] = nextVertex++;
+        index = remap[index];
+    }
+    for (uint32_t& newPosition : remap)
+        if (newPosition == kUnused)
+            newPosition = nextVertex++;
+
+    std::vector<Vertex> reordered(vertices.size());
+    for (size_t v = 0; v < vertices.size(); v++)
+        reordered[remap[v]] = vertices[v];
+    vertices.swap(reordered);
+
+    return remap;
+}
+
+std::vector<uint32_t> MeshOptimizer::simplify(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+                                              size_t targetIndexCount, float* resultError)
+{
+    const size_t vertexCount = vertices.size();
+    std::vector<uint32_t> result(indices.begin(), indices.begin() + indices.size() / 3 * 3);
+    double maxError{ 0.0 };
+
+    //Quadric of each vertex - the planes of all triangles around it
+    std::vector<Quadric> quadrics(vertexCount);
+    for (size_t i = 0; i < result.size(); i += 3)
+    {
+        const Vertex& p0 = vertices[result[i]];
+        QVector3D normal = triangleNormal(p0, vertices[result[i + 1]], vertices[result[i + 2]]);
+        const float length = normal.length();
+        if (length <= 0.f)
+            continue;
+        normal /= length;
+        const double d = -(normal.x() * p0.x + normal.y() * p0.y + normal.z() * p0.z);
+        for (int k = 0; k < 3; k++)
+            quadrics[result[i + k]].addPlane(normal.x(), normal.y(), normal.z(), d, length * 0.5);
+    }
+
+    //Edges used by only one triangle are open edges or seams (where the welding in the loader split a position
+    //because of different uv or normal). Their vertices are locked, so the outline and the seams keep their shape
+    std::vector<char> locked(vertexCount, 0);
+    {
+        std::unordered_map<uint64_t, int> edgeUse;
+        edgeUse.reserve(result.size());
+        for (size_t i = 0; i < result.size(); i += 3)
+            for (int k = 0; k < 3; k++)
+            {
+                const uint64_t a = result[i + k], b = result[i + (k + 1) % 3];
+                ++edgeUse[a < b ? (a << 32 | b) : (b << 32 | a)];
+            }
+        for (const auto& [edge, count] : edgeUse)
+            if (count == 1)
+                locked[edge >> 32] = locked[edge & 0xFFFFFFFFu] = 1;
+    }
+
+    struct Collapse
+    {
+        uint32_t from;
+        uint32_t to;
+        double error;
+    };
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> remap(vertexCount);
+    std::vector<char> touched(vertexCount);
+    std::vector<uint32_t> triangleStart(vertexCount + 1);
+    std::vector<uint32_t> adjacency;
+
+    //Each pass collapses a set of edges that do not share any vertices, cheapest first
+    while (result.size() > targetIndexCount)
+    {
+        const size_t triangleCount = result.size() / 3;
+
+        //Triangles around each vertex
+        std::fill(triangleStart.begin(), triangleStart.end(), 0);
+        for (uint32_t index : result)
+            ++triangleStart[index + 1];
+        std::partial_sum(triangleStart.begin(), triangleStart.end(), triangleStart.begin());
+        adjacency.resize(result.size());
+        {
+            std::vector<uint32_t> fill(triangleStart.begin(), triangleStart.end() - 1);
+            for (size_t t = 0; t < triangleCount; t++)
+                for (int k = 0; k < 3; k++)
+                    adjacency[fill[result[t * 3 + k]]++] = static_cast<uint32_t>(t);
+        }
+
+        //Every directed triangle edge a -> b is a possible collapse of a into b
+        collapses.clear();
+        for (size_t i = 0; i < result.size(); i += 3)
+            for (int k = 0; k < 3; k++)
+            {
+                const uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+                if (locked[a] || a == b)
+                    continue;
+                Quadric q = quadrics[a];
+                q += quadrics[b];
+                const Vertex& target = vertices[b];
+                const double error = std::max(q.evaluate(target.x, target.y, target.z), 0.0) / std::max(q.weight, 1e-12);
+                collapses.push_back({ a, b, error });
+            }
+        if (collapses.empty())
+            break;
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& l, const Collapse& r) { return l.error < r.error; });
+
+        //One collapse removes about two triangles
+        const size_t wantedCollapses = std::max<size_t>(1, (triangleCount - targetIndexCount / 3) / 2);
+        size_t doneCollapses{ 0 };
+        std::iota(remap.begin(), remap.end(), 0u);
+        std::fill(touched.begin(), touched.end(), 0);
+
+        for (const Collapse& collapse : collapses)
+        {
+            if (doneCollapses >= wantedCollapses)
+                break;
+            if (touched[collapse.from] || touched[collapse.to])
+                continue;
+
+            //Do not allow the collapse if any triangle around "from" would flip over
+            bool flips{ false };
+            for (uint32_t a = triangleStart[collapse.from]; a < triangleStart[collapse.from + 1] && !flips; a++)
+            {
+                const uint32_t* triangle = &result[adjacency[a] * 3];
+                if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+                    continue;   //this triangle disappears
+                const Vertex* corner[3];
+                for (int k = 0; k < 3; k++)
+                    corner[k] = &vertices[triangle[k] == collapse.from ? collapse.to : triangle[k]];
+                QVector3D before = triangleNormal(vertices[triangle[0]], vertices[triangle[1]], vertices[triangle[2]]);
+                QVector3D after = triangleNormal(*corner[0], *corner[1], *corner[2]);
+                flips = QVector3D::dotProduct(before, after) <= 0.f;
+            }
+            if (flips)
+                continue;
+
+            //The neighbourhood of "from" changes, so no other collapse touches it in this pass
+            for (uint32_t a = triangleStart[collapse.from]; a < triangleStart[collapse.from + 1]; a++)
+                for (int k = 0; k < 3; k++)
+                    touched[result[adjacency[a] * 3 + k]] = 1;
+            touched[collapse.to] = 1;
+
+            remap[collapse.from] = collapse.to;
+            quadrics[collapse.to] += quadrics[collapse.from];
+            maxError = std::max(maxError, collapse.error);
+            ++doneCollapses;
+        }
+        if (doneCollapses == 0)
+            break;  //nothing more can be collapsed
+
+        //Rebuild the triangles, dropping the ones that collapsed to a line
+        size_t write{ 0 };
+        for (size_t i = 0; i < result.size(); i += 3)
+        {
+            const uint32_t a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+            if (a == b || b == c || a == c)
+                continue;
+            result[write++] = a;
+            result[write++] = b;
+            result[write++] = c;
+        }
+        result.resize(write);
+    }
+
+    if (resultError)
+        *resultError = static_cast<float>(std::sqrt(maxError));
+    return result;
+}
+
+std::vector<Meshlet> MeshOptimizer::buildMeshlets(const std::vector<Vertex>& vertices, const uint32_t* indices, size_t indexCount,
+                                                  size_t maxVertices, size_t maxTriangles)
+{
+    std::vector<Meshlet> meshlets;
+    //The meshlet each vertex was last added to, to count unique vertices without a set
+    std::vector<uint32_t> vertexMeshlet(vertices.size(), ~0u);
+    std::vector<uint32_t> meshletVertices;
+    meshletVertices.reserve(maxVertices);
+
+    //Bounding sphere and normal cone of the triangles [first, last)
+    auto finishMeshlet = [&](size_t first, size_t last)
+    {
+        Meshlet meshlet;
+        meshlet.firstIndex = static_cast<uint32_t>(first);
+        meshlet.indexCount = static_cast<uint32_t>(last - first);
+
+        QVector3D minimum(vertices[meshletVertices[0]].x, vertices[meshletVertices[0]].y, vertices[meshletVertices[0]].z);
+        QVector3D maximum = minimum;
+        for (uint32_t v : meshletVertices)
+        {
+            minimum = QVector3D(std::min(minimum.x(), vertices[v].x), std::min(minimum.y(), vertices[v].y), std::min(minimum.z(), vertices[v].z));
+            maximum = QVector3D(std::max(maximum.x(), vertices[v].x), std::max(maximum.y(), vertices[v].y), std::max(maximum.z(), vertices[v].z));
+        }
+        meshlet.center = (minimum + maximum) * 0.5f;
+        for (uint32_t v : meshletVertices)
+            meshlet.radius = std::max(meshlet.radius, (QVector3D(vertices[v].x, vertices[v].y, vertices[v].z) - meshlet.center).length());
+
+        //Normal cone: the axis is the average normal, the cutoff comes from the normal furthest away from it
+        std::vector<QVector3D> normals;
+        normals.reserve(meshlet.indexCount / 3);
+        QVector3D axis{};
+        for (size_t i = first; i < last; i += 3)
+        {
+            QVector3D normal = triangleNormal(vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]]);
+            const float length = normal.length();
+            if (length <= 0.f)
+                continue;
+            normals.push_back(normal / length);
+            axis += normals.back();
+        }
+        const float axisLength = axis.length();
+        if (axisLength > 0.f && !normals.empty())
+        {
+            axis /= axisLength;
+            float minimumDot{ 1.f };
+            for (const QVector3D& normal : normals)
+                minimumDot = std::min(minimumDot, QVector3D::dotProduct(normal, axis));
+            meshlet.coneAxis = axis;
+            //The cone is only useful if all normals are within about 84 degrees of the axis
+            meshlet.coneCutoff = minimumDot <= 0.1f ? 1.f : std::sqrt(1.f - minimumDot * minimumDot);
+        }
+        meshlets.push_back(meshlet);
+    };
+
+    size_t meshletStart{ 0 };
+    for (size_t i = 0; i + 2 < indexCount; i += 3)
+    {
+        //Vertices of this triangle not already in the meshlet
+        const uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+        const uint32_t current = static_cast<uint32_t>(meshlets.size());
+        const size_t newVertices = (vertexMeshlet[a] != current) + (b != a && vertexMeshlet[b] != current) +
+                                   (c != a && c != b && vertexMeshlet[c] != current);
+
+        const size_t triangles = (i - meshletStart) / 3;
+        if (triangles > 0 && (meshletVertices.size() + newVertices > maxVertices || triangles + 1 > maxTriangles))
+        {
+            finishMeshlet(meshletStart, i);
+            meshletVertices.clear();
+            meshletStart = i;
+        }
+
+        for (int k = 0; k < 3; k++)
+        {
+            const uint32_t v = indices[i + k];
+            if (vertexMeshlet[v] != meshlets.size())
+            {
+                vertexMeshlet[v] = static_cast<uint32_t>(meshlets.size());
+                meshletVertices.push_back(v);
+            }
+        }
+    }
+    if (!meshletVertices.empty())
+        finishMeshlet(meshletStart, indexCount / 3 * 3);
+
+    return meshlets;
+}
@@ -0,0 +1,47 @@
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "Vertex.h"
+#include "Utilities.h"
+
+//Functions that reorder an indexed triangle mesh so the GPU does less work drawing it.
+//They only change the order of triangles and vertices, never the shape of the mesh.
+namespace MeshOptimizer
+{
+    //Result of simulating a post-transform vertex cache
+    struct VertexCacheStats
+    {
+        float acmr{ 0.f };  //Average Cache Miss Ratio: vertex shader runs per triangle. 0.5 is ideal for a grid, 3 is worst
+        float atvr{ 0.f };  //Average Transformed Vertex Ratio: vertex shader runs per vertex. 1 is ideal
+    };
+
+    //Simulates a FIFO vertex cache of cacheSize entries - close to how most GPUs reuse vertex shader results
+    VertexCacheStats analyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, unsigned cacheSize = 16);
+
+    //Reorders the triangles in indices[0, indexCount) for vertex cache reuse,
+    //using Tom Forsyth's "Linear-Speed Vertex Cache Optimisation"
+    void optimizeVertexCache(uint32_t* indices, size_t indexCount, size_t vertexCount);
+
+    //Reorders the vertices in the order the index buffer first uses them, and updates the indices.
+    //Vertices not used by any triangle are moved to the end.
+    //Returns the remap table: new position of each old vertex.
+    std::vector<uint32_t> optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+
+    //Simplifies the mesh with quadric error edge collapse until about targetIndexCount indices are left.
+    //No vertices are moved or made - the returned indices use the same vertex array.
+    //Vertices on open edges and attribute seams are locked, so UVs and hard normals stay intact.
+    //resultError gets the largest error made, as a distance in mesh units
+    std::vector<uint32_t> simplify(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+                                   size_t targetIndexCount, float* resultError = nullptr);
+
+    //Splits indices[0, indexCount) in order into meshlets of at most maxVertices unique vertices and maxTriangles triangles.
+    //The triangles are not moved, so the index buffer should be cache optimized first to get compact meshlets.
+    //firstIndex of the meshlets count from indices
+    std::vector<Meshlet> buildMeshlets(const std::vector<Vertex>& vertices, const uint32_t* indices, size_t indexCount,
+                                       size_t maxVertices = 64, size_t maxTriangles = 124);
+}
+
+#endif // MESHOPTIMIZER_H
@@ -0,0 +1,347 @@
+#include "PagedTerrain.h"
+#include "stb_image.h"
+#include "FractalNoise.h"
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+bool PagedTerrain::writeTiles(const std::string& tileFile, int width, int depth, const TerrainPlacement& placement, int tileQuads,
+                              const std::function<bool(int row, unsigned char* samples)>& readRow)
+{
+    if (width < 2 || depth < 2 || tileQuads <= 0 || tileQuads % HeightMap::kChunkQuads != 0)
+        return false;
+    std::ofstream file(tileFile, std::ios::binary);
+    if (!file)
+        return false;
+
+    FileHeader header;
+    header.width = width;
+    header.depth = depth;
+    header.tileQuads = tileQuads;
+    header.placement = placement;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    //One band of tiles at a time: tileQuads + 1 rows of the source, the last one shared with the next band
+    const int tileSide = tileQuads + 1;
+    const int tilesW = (width - 2) / tileQuads + 1;
+    const int tilesD = (depth - 2) / tileQuads + 1;
+    std::vector<unsigned char> band(static_cast<size_t>(tileSide) * width);
+    std::vector<unsigned char> tile(static_cast<size_t>(tileSide) * tileSide);
+    for (int tileD = 0; tileD < tilesD; tileD++)
+    {
+        //Rows past the last one are padded with the last one
+        for (int row = 0; row < tileSide; row++)
+        {
+            if (!readRow(std::min(tileD * tileQuads + row, depth - 1), band.data() + static_cast<size_t>(row) * width))
+                return false;
+        }
+        for (int tileW = 0; tileW < tilesW; tileW++)
+        {
+            for (int row = 0; row < tileSide; row++)
+            {
+                const unsigned char* source = band.data() + static_cast<size_t>(row) * width;
+                for (int column = 0; column < tileSide; column++)
+                    tile[row * tileSide + column] = source[std::min(tileW * tileQuads + column, width - 1)];
+            }
+            file.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+        }
+    }
+    qDebug() << "Wrote" << tilesW * tilesD << "terrain tiles to" << tileFile.c_str();
+    return static_cast<bool>(file);
+}
+
+bool PagedTerrain::convertImage(const std::string& imageFile, const std::string& tileFile, const TerrainPlacement& placement, int tileQuads)
+{
+    int width{ 0 }, depth{ 0 }, channels{ 0 };
+    //Loaded as grey, as HeightMap::makeTerrain(std::string) does, so the tiles get the same heights as the static terrain.
+    //The tiles are 8 bit - a 16 bit image keeps only its high byte
+    stbi_uc* pixelData = stbi_load(imageFile.c_str(), &width, &depth, &channels, STBI_grey);
+    if (pixelData == nullptr)
+    {
+        qDebug() << "Failed to load heightmap image!";
+        return false;
+    }
+    const bool ok = writeTiles(tileFile, width, depth, placement, tileQuads, [&](int row, unsigned char* samples) {
+        memcpy(samples, pixelData + static_cast<size_t>(row) * width, width);
+        return true;
+    });
+    stbi_image_free(pixelData);
+    return ok;
+}
+
+bool PagedTerrain::convertRaw(const std::string& rawFile, int width, int depth, const std::string& tileFile,
+                              const TerrainPlacement& placement, int tileQuads)
+{
+    std::ifstream file(rawFile, std::ios::binary);
+    if (!file)
+    {
+        qDebug() << "ERROR: Could not open file for reading: " << rawFile.c_str();
+        return false;
+    }
+    return writeTiles(tileFile, width, depth, placement, tileQuads, [&](int row, unsigned char* samples) {
+        file.seekg(static_cast<std::streamoff>(row) * width);
+        file.read(reinterpret_cast<char*>(samples), width);
+        return static_cast<bool>(file);
+    });
+}
+
+bool PagedTerrain::convertNoise(const FractalNoise& noise, int width, int depth, const std::string& tileFile,
+                                const TerrainPlacement& placement, int tileQuads)
+{
+    std::vector<float> values(std::max(width, 0));
+    return writeTiles(tileFile, width, depth, placement, tileQuads, [&](int row, unsigned char* samples) {
+        noise.sampleRow(row, 0, width, values.data());
+        for (int w = 0; w < width; w++)
+            samples[w] = static_cast<unsigned char>(std::lrint(std::clamp(values[w], 0.f, 1.f) * 255.f));
+        return true;
+    });
+}
+
+PagedTerrain::PagedTerrain(const std::string& tileFile, size_t memoryBudget, unsigned workerCount)
+    : mTileFile(tileFile), mMemoryBudget(memoryBudget)
+{
+    std::ifstream file(tileFile, std::ios::binary);
+    FileHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, FileHeader{}.magic, 4) != 0 ||
+        header.version != FileHeader{}.version || header.width < 2 || header.depth < 2 || header.tileQuads == 0)
+    {
+        qDebug() << "ERROR: Not a terrain tile file: " << tileFile.c_str();
+        return;
+    }
+    mHeader = header;
+    mTilesW = (header.width - 2) / header.tileQuads + 1;
+    mTilesD = (header.depth - 2) / header.tileQuads + 1;
+    mTileCount = mTilesW * mTilesD;
+    mResidentSlot.assign(mTileCount, -1);
+    mTileState.assign(mTileCount, TileState::NotLoaded);
+
+    for (unsigned i = 0; i < std::max(workerCount, 1u); i++)
+        mWorkers.emplace_back(&PagedTerrain::workerLoop, this);
+}
+
+PagedTerrain::~PagedTerrain()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mWorkAvailable.notify_all();
+    for (std::thread& worker : mWorkers)
+        worker.join();
+}
+
+void PagedTerrain::workerLoop()
+{
+    std::ifstream file(mTileFile, std::ios::binary);
+    std::vector<unsigned char> samples;
+    while (true)
+    {
+        int tileIndex{ -1 };
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWorkAvailable.wait(lock, [this] { return mStopping || !mQueue.empty(); });
+            if (mStopping)
+                return;
+            tileIndex = mQueue.front();
+            mQueue.pop_front();
+            mTileState[tileIndex] = TileState::Loading;
+        }
+
+        Tile tile = makeTile(file, tileIndex, samples);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFinished.push_back(std::move(tile));
+    }
+}
+
+PagedTerrain::Tile PagedTerrain::makeTile(std::ifstream& file, int tileIndex, std::vector<unsigned char>& samples) const
+{
+    const int tileQuads = static_cast<int>(mHeader.tileQuads);
+    const int tileSide = tileQuads + 1;
+    Tile tile;
+    tile.tileW = tileIndex % mTilesW;
+    tile.tileD = tileIndex / mTilesW;
+
+    samples.resize(static_cast<size_t>(tileSide) * tileSide);
+    file.clear();
+    file.seekg(sizeof(FileHeader) + static_cast<std::streamoff>(tileIndex) * samples.size());
+    if (!file.read(reinterpret_cast<char*>(samples.data()), samples.size()))
+        qDebug() << "ERROR: Could not read terrain tile" << tile.tileW << tile.tileD;
+
+    //The tiles on the far edges are cut to the size of the terrain - the padding is not drawn
+    const int width = std::min(tileQuads, static_cast<int>(mHeader.width) - 1 - tile.tileW * tileQuads) + 1;
+    const int depth = std::min(tileQuads, static_cast<int>(mHeader.depth) - 1 - tile.tileD * tileQuads) + 1;
+    if (width < tileSide)
+    {
+        for (int row = 1; row < depth; row++)
+            memmove(samples.data() + row * width, samples.data() + row * tileSide, width);
+    }
+
+    TerrainPlacement placement = mHeader.placement;
+    placement.originX += tile.tileW * tileQuads * placement.spacing;
+    placement.originZ -= tile.tileD * tileQuads * placement.spacing;
+
+    tile.mesh = std::make_unique<HeightMap>();
+    tile.mesh->setName("terrain tile " + std::to_string(tile.tileW) + " " + std::to_string(tile.tileD));
+    tile.mesh->makeTerrain(samples.data(), width, depth, placement);
+    tile.mesh->optimizeMesh();
+    tile.bytes = tile.mesh->getTerrainVertices().size() * sizeof(TerrainVertex) + tile.mesh->getIndexCount() * sizeof(uint32_t) +
+                 static_cast<size_t>(width) * depth * sizeof(float);
+    return tile;
+}
+
+void PagedTerrain::update(const QVector3D& cameraPosition, std::vector<std::unique_ptr<HeightMap>>& evicted)
+{
+    if (mTileCount == 0)
+        return;
+    mFrame++;
+
+    //The tiles the workers have made since last frame
+    std::vector<Tile> finished;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        finished.swap(mFinished);
+        for (const Tile& tile : finished)
+            mTileState[tile.tileW + tile.tileD * mTilesW] = TileState::Resident;
+    }
+    for (Tile& tile : finished)
+    {
+        tile.lastUsedFrame = mFrame;
+        mResidentBytes += tile.bytes;
+        mResidentSlot[tile.tileW + tile.tileD * mTilesW] = static_cast<int>(mResident.size());
+        mResident.push_back(std::move(tile));
+    }
+
+    //Tiles within the load radius, closest first
+    const float tileSize = mHeader.tileQuads * mHeader.placement.spacing;
+    const float gridX = cameraPosition.x() - mHeader.placement.originX;     //meters from the first sample
+    const float gridZ = mHeader.placement.originZ - cameraPosition.z();
+    const int firstW = std::clamp(static_cast<int>(std::floor((gridX - mLoadRadius) / tileSize)), 0, mTilesW);
+    const int lastW = std::clamp(static_cast<int>(std::floor((gridX + mLoadRadius) / tileSize)) + 1, 0, mTilesW);
+    const int firstD = std::clamp(static_cast<int>(std::floor((gridZ - mLoadRadius) / tileSize)), 0, mTilesD);
+    const int lastD = std::clamp(static_cast<int>(std::floor((gridZ + mLoadRadius) / tileSize)) + 1, 0, mTilesD);
+    std::vector<std::pair<float, int>> wanted;
+    for (int d = firstD; d < lastD; d++)
+    {
+        for (int w = firstW; w < lastW; w++)
+        {
+            const float dx = std::max({ w * tileSize - gridX, 0.f, gridX - (w + 1) * tileSize });
+            const float dz = std::max({ d * tileSize - gridZ, 0.f, gridZ - (d + 1) * tileSize });
+            const float distance = std::sqrt(dx * dx + dz * dz);
+            if (distance <= mLoadRadius)
+                wanted.emplace_back(distance, w + d * mTilesW);
+        }
+    }
+    std::sort(wanted.begin(), wanted.end());
+
+    //No more than the budget holds - the rest would only push out the closer ones
+    const size_t tileBytes = (static_cast<size_t>(mHeader.tileQuads) + 1) * (mHeader.tileQuads + 1) * (sizeof(TerrainVertex) + sizeof(float)) +
+                             static_cast<size_t>(mHeader.tileQuads) * (mHeader.tileQuads / HeightMap::kChunkQuads) *
+                             (2 * (HeightMap::kChunkQuads + 1) + 1) * sizeof(uint32_t);     //a strip for each row of each chunk
+    wanted.resize(std::min(wanted.size(), std::max<size_t>(mMemoryBudget / tileBytes, 1)));
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (int tileIndex : mQueue)
+            mTileState[tileIndex] = TileState::NotLoaded;
+        mQueue.clear();
+        for (const auto& [distance, tileIndex] : wanted)
+        {
+            if (mTileState[tileIndex] == TileState::Resident)
+                mResident[mResidentSlot[tileIndex]].lastUsedFrame = mFrame;
+            else if (mTileState[tileIndex] == TileState::NotLoaded)
+            {
+                mTileState[tileIndex] = TileState::Queued;
+                mQueue.push_back(tileIndex);
+            }
+        }
+    }
+    mWorkAvailable.notify_all();
+
+    //Least recently used first, but never a tile wanted this frame
+    while (mResidentBytes > mMemoryBudget)
+    {
+        size_t oldest = mResident.size();
+        for (size_t slot = 0; slot < mResident.size(); slot++)
+        {
+            if (mResident[slot].lastUsedFrame < mFrame && (oldest == mResident.size() || mResident[slot].lastUsedFrame < mResident[oldest].lastUsedFrame))
+                oldest = slot;
+        }
+        if (oldest == mResident.size())
+            break;
+        evict(oldest, evicted);
+    }
+}
+
+void PagedTerrain::evict(size_t slot, std::vector<std::unique_ptr<HeightMap>>& evicted)
+{
+    const int tileIndex = mResident[slot].tileW + mResident[slot].tileD * mTilesW;
+    mResidentBytes -= mResident[slot].bytes;
+    evicted.push_back(std::move(mResident[slot].mesh));
+    mResidentSlot[tileIndex] = -1;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTileState[tileIndex] = TileState::NotLoaded;
+    }
+
+    //The last tile takes the empty slot
+    if (slot + 1 != mResident.size())
+    {
+        mResident[slot] = std::move(mResident.back());
+        mResidentSlot[mResident[slot].tileW + mResident[slot].tileD * mTilesW] = static_cast<int>(slot);
+    }
+    mResident.pop_back();
+}
+
+int PagedTerrain::residentSlotAt(float x, float z) const
+{
+    if (mTileCount == 0)
+        return -1;
+
+    const float gridX = (x - mHeader.placement.originX) / mHeader.placement.spacing;
+    const float gridZ = (mHeader.placement.originZ - z) / mHeader.placement.spacing;
+    if (!(gridX >= 0.f && gridZ >= 0.f && gridX <= mHeader.width - 1.f && gridZ <= mHeader.depth - 1.f))
+        return -1;
+
+    //On the edge between two tiles both have the same samples, so either can be used
+    const int tileW = std::min(static_cast<int>(gridX) / static_cast<int>(mHeader.tileQuads), mTilesW - 1);
+    const int tileD = std::min(static_cast<int>(gridZ) / static_cast<int>(mHeader.tileQuads), mTilesD - 1);
+    return mResidentSlot[tileW + tileD * mTilesW];
+}
+
+float PagedTerrain::getHeightAt(const QVector3D& positionXZ, bool* isResident) const
+{
+    const int slot = residentSlotAt(positionXZ.x(), positionXZ.z());
+    if (isResident)
+        *isResident = slot >= 0;
+    return slot >= 0 ? mResident[slot].mesh->getHeightAt(positionXZ) : 0.f;
+}
+
+void PagedTerrain::getHeightsAt(std::span<const QVector2D> positionsXZ, std::span<float> heights, std::span<uint8_t> isResident) const
+{
+    const size_t count = std::min({ positionsXZ.size(), heights.size(), isResident.size() });
+    //Runs of positions in the same tile go to the getHeightsAt() of its HeightMap together
+    size_t first{ 0 };
+    int slot = count > 0 ? residentSlotAt(positionsXZ[0].x(), positionsXZ[0].y()) : -1;
+    while (first < count)
+    {
+        size_t last = first + 1;
+        int nextSlot{ -1 };
+        for (; last < count; last++)
+        {
+            nextSlot = residentSlotAt(positionsXZ[last].x(), positionsXZ[last].y());
+            if (nextSlot != slot)
+                break;
+        }
+
+        if (slot >= 0)
+            mResident[slot].mesh->getHeightsAt(positionsXZ.subspan(first, last - first), heights.subspan(first, last - first));
+        else
+            std::fill(heights.begin() + first, heights.begin() + last, 0.f);
+        std::fill(isResident.begin() + first, isResident.begin() + last, slot >= 0 ? 1 : 0);
+
+        first = last;
+        slot = nextSlot;
+    }
+}
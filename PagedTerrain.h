@@ -0,0 +1,121 @@
+#ifndef PAGEDTERRAIN_H
+#define PAGEDTERRAIN_H
+
+#include <QVector3D>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <functional>
+#include "HeightMap.h"
+
+class FractalNoise;
+
+//Terrain too big to hold in memory. The heights are stored on disk in square tiles (see convertImage()),
+//and only the tiles around the camera are read. Each resident tile is a HeightMap of its own, made on worker threads.
+//When the tiles use more than the memory budget, the ones used longest ago are evicted.
+//All functions are meant to be called from one thread - the render thread - the workers only read the file and make meshes
+class PagedTerrain
+{
+public:
+    //A tile in memory
+    struct Tile
+    {
+        int tileW{ 0 };
+        int tileD{ 0 };
+        std::unique_ptr<HeightMap> mesh;
+        uint64_t lastUsedFrame{ 0 };
+        size_t bytes{ 0 };      //host memory of the mesh and heights
+    };
+
+    //Writes an image as a tile file, loaded as grey like HeightMap::makeTerrain(std::string) does. tileQuads is the size
+    //of the tiles in quads - a multiple of HeightMap::kChunkQuads. The image is read whole, so this is done once, ahead of time
+    static bool convertImage(const std::string& imageFile, const std::string& tileFile, const TerrainPlacement& placement,
+                             int tileQuads = 4 * HeightMap::kChunkQuads);
+    //The same from a raw file of one byte per sample, row-major. It is read a band of tiles at a time,
+    //so it can be bigger than memory
+    static bool convertRaw(const std::string& rawFile, int width, int depth, const std::string& tileFile,
+                           const TerrainPlacement& placement, int tileQuads = 4 * HeightMap::kChunkQuads);
+    //A tile file of FractalNoise, made a row at a time - for testing with terrains of any size.
+    //placement.heightScale is per step of the 8 bit samples
+    static bool convertNoise(const FractalNoise& noise, int width, int depth, const std::string& tileFile,
+                             const TerrainPlacement& placement, int tileQuads = 4 * HeightMap::kChunkQuads);
+
+    //Opens a tile file made by convertImage() or convertRaw(). Nothing is read before update()
+    explicit PagedTerrain(const std::string& tileFile, size_t memoryBudget = 256 * 1024 * 1024, unsigned workerCount = 2);
+    ~PagedTerrain();
+
+    bool isOpen() const { return mTileCount > 0; }
+
+    //Call once a frame. Asks the workers for the tiles within the load radius of cameraPosition, closest first,
+    //takes in the tiles they have made, and evicts tiles until the budget holds. The evicted tiles are moved to evicted,
+    //so their GPU buffers can be released before they are deleted
+    void update(const QVector3D& cameraPosition, std::vector<std::unique_ptr<HeightMap>>& evicted);
+
+    //Height of the terrain under positionXZ, from the tile it is in. isResident is set to false, and 0 returned,
+    //if that tile is not in memory (yet) - or if the position is outside the terrain
+    float getHeightAt(const QVector3D& positionXZ, bool* isResident = nullptr) const;
+    //getHeightAt() for many positions - (x, z) pairs - at once. isResident[i] is 1 where heights[i] is from a tile in memory.
+    //Positions next to each other in the same tile are done with one HeightMap::getHeightsAt()
+    void getHeightsAt(std::span<const QVector2D> positionsXZ, std::span<float> heights, std::span<uint8_t> isResident) const;
+
+    const std::vector<Tile>& getResidentTiles() const { return mResident; }
+
+    void setMemoryBudget(size_t bytes) { mMemoryBudget = bytes; }
+    size_t getMemoryBudget() const { return mMemoryBudget; }
+    size_t getResidentBytes() const { return mResidentBytes; }
+    //Tiles with some part closer than this many meters to the camera are loaded
+    void setLoadRadius(float meters) { mLoadRadius = meters; }
+
+private:
+    //Start of the tile file, followed by the tiles, row by row. Each tile is (tileQuads + 1)^2 bytes, sharing the
+    //edge samples with the tiles next to it. Tiles on the far edges are padded to the same size
+    struct FileHeader
+    {
+        char magic[4]{ 'T', 'I', 'L', 'E' };
+        uint32_t version{ 1 };
+        uint32_t width{ 0 };        //samples of the whole terrain
+        uint32_t depth{ 0 };
+        uint32_t tileQuads{ 0 };
+        TerrainPlacement placement{};
+    };
+    static bool writeTiles(const std::string& tileFile, int width, int depth, const TerrainPlacement& placement, int tileQuads,
+                           const std::function<bool(int row, unsigned char* samples)>& readRow);
+
+    FileHeader mHeader{};
+    std::string mTileFile;
+    int mTilesW{ 0 };
+    int mTilesD{ 0 };
+    int mTileCount{ 0 };
+
+    size_t mMemoryBudget{ 0 };
+    size_t mResidentBytes{ 0 };
+    float mLoadRadius{ 200.f };
+    uint64_t mFrame{ 0 };
+
+    //Render thread only
+    std::vector<Tile> mResident;
+    std::vector<int> mResidentSlot;     //for each tile, its index in mResident, -1 if not resident
+
+    //Shared with the workers
+    enum class TileState : uint8_t { NotLoaded, Queued, Loading, Resident };
+    std::vector<TileState> mTileState;  //for each tile
+    std::mutex mMutex;
+    std::condition_variable mWorkAvailable;
+    std::deque<int> mQueue;             //tiles to read, closest first
+    std::vector<Tile> mFinished;        //made by the workers, not taken in by update() yet
+    bool mStopping{ false };
+    std::vector<std::thread> mWorkers;
+    void workerLoop();
+    Tile makeTile(std::ifstream& file, int tileIndex, std::vector<unsigned char>& samples) const;
+
+    void evict(size_t slot, std::vector<std::unique_ptr<HeightMap>>& evicted);
+    //Index in mResident of the tile under (x, z), -1 if it is not in memory or (x, z) is outside the terrain
+    int residentSlotAt(float x, float z) const;
+};
+
+#endif // PAGEDTERRAIN_H
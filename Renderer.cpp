@@ -1,11 +1,20 @@
 #include "Renderer.h"
 #include <QVulkanFunctions>
 #include <QFile>
+#include <QFileInfo>
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
 #include <fstream>
 #include "VulkanWindow.h"
 #include "WorldAxis.h"
 #include "objectmesh.h"
 #include "HeightMap.h"
+#include "PagedTerrain.h"
+#include "FractalNoise.h"
+#include "AllocationCounter.h"
+#include "Frustum.h"
+#include "TriangleSurface.h"
 #include "stb_image.h"
 
 /*** Renderer class ***/
@@ -31,7 +40,22 @@ Renderer::Renderer(QVulkanWindow *w, bool msaa)
     mObjects.at(0)->setName("WorldAxis");
     mObjects.at(1)->setName("terrain");
     mObjects.at(2)->setName("Player");
-    static_cast<HeightMap*>(mObjects.at(1))->makeTerrain("../../Assets/Heightmap.jpg");
+    static_cast<HeightMap*>(mObjects.at(1))->makeTerrain("../../Assets/Heightmap.jpg");   //16 bit PNG or .r16 heightmaps keep all 16 bits
+    //Big heightmaps: makeDisplacedTerrain() keeps only the heights, and terrain.vert makes the mesh on the GPU
+    //static_cast<HeightMap*>(mObjects.at(1))->makeDisplacedTerrain("../../Assets/Heightmap.jpg");
+    //Made up terrains of any size, ie. for testing: the same seed gives the same terrain
+    //static_cast<HeightMap*>(mObjects.at(1))->makeNoiseTerrain(4097, 4097, FractalNoise({ 1234 }));
+    //Terrains bigger than memory: made once with PagedTerrain::convertImage() or convertRaw(), then read in tiles around the camera
+    //mPagedTerrain = std::make_unique<PagedTerrain>("../../Assets/Heightmap.tiles");
+
+    //Reorder the meshes for the vertex caches and make the levels of detail,
+    //before initResources() makes the index buffers
+    for (auto it=mObjects.begin(); it!=mObjects.end(); it++)
+    {
+        (*it)->optimizeMesh();
+        (*it)->generateLods();
+        (*it)->buildMeshlets();
+    }
 
     // **************************************
     // Legger inn objekter i map
@@ -43,6 +67,11 @@ Renderer::Renderer(QVulkanWindow *w, bool msaa)
      // Convenience pointer to the player
      mPlayer = mObjects.at(2);
 
+     //The transforms of the scene go into the TransformStore, after the meshes are done (for the bounding spheres)
+     for (VisualObject* object : mObjects)
+         mTransforms.add(object);
+     mPlayer->setFollowsTerrain(true);
+
      //Inital position of the camera
     mCamera.setPosition(QVector3D(-0.5, -0.5, -8));
 
@@ -54,6 +83,499 @@ Renderer::Renderer(QVulkanWindow *w, bool msaa)
 
 }
 
+namespace
+{
+//Obj files this big are streamed to the GPU in chunks, see Renderer::StreamedImport
+constexpr qint64 kStreamedImportBytes{ 256 * 1024 * 1024 };
+
+//Cull mode of the mesh pipelines. The meshes are drawn from both sides while it is VK_CULL_MODE_NONE -
+//open meshes as the walls need that - so the meshlets are then only frustum culled, never backface culled
+constexpr VkCullModeFlags kMeshCullMode{ VK_CULL_MODE_NONE };
+
+//Each upload waits for the queue, so only a few new terrain tiles are uploaded each frame
+constexpr int kTileUploadsPerFrame{ 2 };
+
+//A height is a few nanoseconds, so clampToGround() only starts threads for thousands of objects
+constexpr size_t kMinGroundClampsPerThread{ 4096 };
+
+//Push constants of terrain.vert - the model matrix first, as in the other shaders
+struct TerrainPushConstants
+{
+    float model[16];
+    float originX;
+    float originZ;
+    float spacing;
+    float heightScale;
+    float heightOffset;
+    int32_t gridWidth;
+    int32_t gridDepth;
+    float cameraX;
+    float cameraY;
+    float cameraZ;
+    //Pushed again for each node
+    int32_t nodeStartW;
+    int32_t nodeStartD;
+    int32_t nodeStride;
+    float morphStart;
+    float morphEnd;
+};
+static_assert(sizeof(TerrainPushConstants) == 124, "Must match the push constants in terrain.vert");
+//128 bytes is the least push constant space a Vulkan device can have
+
+//The model matrix and the terrain parameters - the same for all nodes or chunks of the terrain
+TerrainPushConstants terrainPushConstants(const HeightMap* heightMap, float heightScale)
+{
+    TerrainPushConstants pushConstants{};
+    memcpy(pushConstants.model, heightMap->getMatrix().constData(), sizeof(pushConstants.model));
+    pushConstants.originX = heightMap->getOriginX();
+    pushConstants.originZ = heightMap->getOriginZ();
+    pushConstants.spacing = heightMap->getSpacing();
+    pushConstants.heightScale = heightScale;
+    pushConstants.heightOffset = heightMap->getHeightOffset();
+    pushConstants.gridWidth = heightMap->getGridWidth();
+    pushConstants.gridDepth = heightMap->getGridDepth();
+    return pushConstants;
+}
+}
+
+//Shared between the thread streaming the obj file and the render thread.
+//The worker fills the staging chunks in turn and queues them, the render thread copies them to the GPU and frees them.
+//Host memory is kStagingChunks staging buffers, however big the file is
+struct Renderer::StreamedImport : public ObjStreamSink
+{
+    static constexpr int kStagingChunks{ 4 };
+    static constexpr VkDeviceSize kIndexOffset{ kChunkVertexCount * sizeof(Vertex) };   //where the indices start in a chunk
+    static constexpr VkDeviceSize kChunkSize{ kIndexOffset + kChunkIndexCount * sizeof(uint32_t) };
+
+    VisualObject* object{ nullptr };
+    bool inScene{ false };      //streamed again after releaseResources() - the object is already in mObjects
+    std::thread worker;
+    BufferHandle staging[kStagingChunks]{};
+    char* stagingMemory[kStagingChunks]{};     //mapped as long as the import runs
+    BufferHandle vertexBuffer{};
+    BufferHandle indexBuffer{};
+    size_t uploadedVertexCount{ 0 };
+    size_t uploadedIndexCount{ 0 };
+
+    //Guarded by mutex:
+    std::mutex mutex;
+    std::condition_variable chunkFreed;
+    bool sizesKnown{ false };
+    size_t maxVertexCount{ 0 };
+    size_t indexCount{ 0 };
+    bool chunkBusy[kStagingChunks]{};           //being written by the worker, or waiting for upload
+    size_t chunkVertexCount[kStagingChunks]{};
+    size_t chunkIndexCount[kStagingChunks]{};
+    std::vector<int> filledChunks;              //in the order they were filled
+    int writeChunk{ -1 };
+    bool finished{ false };
+    bool ok{ false };
+    bool cancelled{ false };
+
+    void begin(size_t vertexCount, size_t indices) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        maxVertexCount = vertexCount;
+        indexCount = indices;
+        sizesKnown = true;
+    }
+
+    void nextChunk(Vertex*& vertices, uint32_t*& indices) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        chunkFreed.wait(lock, [this]() { return cancelled || std::find(chunkBusy, chunkBusy + kStagingChunks, false) != chunkBusy + kStagingChunks; });
+        //When cancelled nothing more is uploaded, so any chunk can be written over
+        writeChunk = cancelled ? 0 : static_cast<int>(std::find(chunkBusy, chunkBusy + kStagingChunks, false) - chunkBusy);
+        chunkBusy[writeChunk] = true;
+        vertices = reinterpret_cast<Vertex*>(stagingMemory[writeChunk]);
+        indices = reinterpret_cast<uint32_t*>(stagingMemory[writeChunk] + kIndexOffset);
+    }
+
+    void chunkFilled(size_t vertexCount, size_t indices) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        chunkVertexCount[writeChunk] = vertexCount;
+        chunkIndexCount[writeChunk] = indices;
+        filledChunks.push_back(writeChunk);
+    }
+
+    void end(bool success) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ok = success;
+        finished = true;
+    }
+
+    void cancel()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cancelled = true;
+        }
+        chunkFreed.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+};
+
+Renderer::~Renderer()
+{
+    //Imports still running would add to mPendingObjects after we are gone
+    for (std::thread& importThread : mImportThreads)
+        importThread.join();
+    //Imported, but never added to the scene
+    for (VisualObject* object : mPendingObjects)
+        delete object;
+    //Normally done in releaseResources(), which also frees their buffers
+    for (std::unique_ptr<StreamedImport>& import : mStreamedImports)
+        import->cancel();
+}
+
+void Renderer::importObjectAsync(const std::string& filename)
+{
+    const QFileInfo fileInfo(QString::fromStdString(filename));
+    const bool isObj = fileInfo.suffix().compare("obj", Qt::CaseInsensitive) == 0;
+    if (isObj && fileInfo.size() >= kStreamedImportBytes)
+    {
+        startStreamedImport(filename);
+        return;
+    }
+
+    mImportThreads.emplace_back([this, filename, isObj]()
+    {
+        //Everything that only needs the CPU is done here, on the worker thread
+        VisualObject* object = isObj ? static_cast<VisualObject*>(new ObjectMesh(filename)) : new TriangleSurface(filename);
+        object->setName(filename);
+        object->optimizeMesh();
+        object->generateLods();
+        object->buildMeshlets();
+
+        std::lock_guard<std::mutex> lock(mPendingObjectsMutex);
+        mPendingObjects.push_back(object);
+        mFinishedImportThreads.push_back(std::this_thread::get_id());
+    });
+}
+
+//Makes the buffers for the imported objects that are ready, and adds them to the scene.
+//Only the new objects are uploaded, the rest of the scene is not touched
+void Renderer::addPendingObjects()
+{
+    uploadStreamedImports();
+
+    std::vector<VisualObject*> readyObjects;
+    std::vector<std::thread::id> finishedThreads;
+    {
+        std::lock_guard<std::mutex> lock(mPendingObjectsMutex);
+        if (mPendingObjects.empty())
+            return;
+        readyObjects.swap(mPendingObjects);
+        finishedThreads.swap(mFinishedImportThreads);
+    }
+
+    //The threads that made them have nothing left to do but return, so joining them does not wait
+    for (std::thread::id id : finishedThreads)
+    {
+        auto thread = std::find_if(mImportThreads.begin(), mImportThreads.end(),
+                                   [id](const std::thread& importThread) { return importThread.get_id() == id; });
+        if (thread == mImportThreads.end())
+            continue;
+        thread->join();
+        mImportThreads.erase(thread);
+    }
+
+    const VkDeviceSize uniAlign = mWindow->physicalDeviceProperties()->limits.minUniformBufferOffsetAlignment;
+    for (VisualObject* object : readyObjects)
+    {
+        if (object->getVertices().empty())
+        {
+            qDebug() << "Import of" << object->getName().c_str() << "gave no vertices";
+            delete object;
+            continue;
+        }
+
+        createVertexBuffer(uniAlign, object);
+        if (!object->getIndices().empty())
+            createIndexBuffer(uniAlign, object);
+
+        mObjects.push_back(object);
+        mTransforms.add(object);
+        mMap.insert(std::pair<std::string, VisualObject*>{object->getName(), object});
+        qDebug() << "Imported" << object->getName().c_str();
+    }
+}
+
+void Renderer::updatePagedTerrain()
+{
+    if (!mPagedTerrain)
+        return;
+
+    const QVector3D cameraPosition = mCamera.viewMatrix().inverted().map(QVector3D(0.f, 0.f, 0.f));
+    std::vector<std::unique_ptr<HeightMap>> evicted;
+    mPagedTerrain->update(cameraPosition, evicted);
+    for (std::unique_ptr<HeightMap>& tile : evicted)
+        releasePagedTerrainBuffers(tile.get());
+
+    //New tiles, and all of them again after releaseResources()
+    const VkDeviceSize uniAlign = mWindow->physicalDeviceProperties()->limits.minUniformBufferOffsetAlignment;
+    int uploads{ 0 };
+    for (const PagedTerrain::Tile& tile : mPagedTerrain->getResidentTiles())
+    {
+        if (tile.mesh->getVBuffer() != VK_NULL_HANDLE)
+            continue;
+        if (uploads++ == kTileUploadsPerFrame)
+            break;
+        const std::vector<TerrainVertex>& terrainVertices = tile.mesh->getTerrainVertices();
+        createVertexBuffer(uniAlign, tile.mesh.get(), terrainVertices.data(), terrainVertices.size() * sizeof(TerrainVertex));
+        createIndexBuffer(uniAlign, tile.mesh.get());
+    }
+}
+
+void Renderer::clampToGround()
+{
+    //Linear over the flags of the TransformStore, the objects themselves are not touched
+    const std::vector<uint8_t>& flags = mTransforms.getFlags();
+    mGroundFollowers.clear();
+    for (uint32_t entity = 0; entity < flags.size(); entity++)
+        if (flags[entity] & TransformStore::kFollowsTerrain)
+            mGroundFollowers.push_back(entity);
+    size_t count = mGroundFollowers.size();
+    if (count == 0)
+        return;
+
+    mGroundPositions.resize(count);
+    mGroundHeights.resize(count);
+    std::vector<QVector3D>& positions = mTransforms.getPositions();
+    const std::vector<float>& radii = mTransforms.getRadii();
+    for (size_t i = 0; i < count; i++)
+    {
+        const QVector3D& position = positions[mGroundFollowers[i]];
+        mGroundPositions[i] = QVector2D(position.x(), position.z());
+    }
+
+    //The paged terrain is the ground where its tiles are in memory. Only the positions outside them
+    //are left in mGroundFollowers and mGroundPositions for the static terrain
+    if (mPagedTerrain)
+    {
+        mGroundResident.resize(count);
+        runInBands(count, kMinGroundClampsPerThread, [&](size_t first, size_t last) {
+            mPagedTerrain->getHeightsAt(std::span<const QVector2D>(mGroundPositions).subspan(first, last - first),
+                                        std::span<float>(mGroundHeights).subspan(first, last - first),
+                                        std::span<uint8_t>(mGroundResident).subspan(first, last - first));
+        });
+        size_t remaining{ 0 };
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint32_t entity = mGroundFollowers[i];
+            if (mGroundResident[i])
+            {
+                positions[entity].setY(mGroundHeights[i] + radii[entity]);
+                mTransforms.markChanged(entity);
+                continue;
+            }
+            mGroundFollowers[remaining] = entity;
+            mGroundPositions[remaining++] = mGroundPositions[i];
+        }
+        count = remaining;
+        if (count == 0)
+            return;
+    }
+
+    const auto* terrain = static_cast<const HeightMap*>(mObjects.at(1));
+    runInBands(count, kMinGroundClampsPerThread, [&](size_t first, size_t last) {
+        terrain->getHeightsAt(std::span<const QVector2D>(mGroundPositions).subspan(first, last - first),
+                              std::span<float>(mGroundHeights).subspan(first, last - first));
+        for (size_t i = first; i < last; i++)
+        {
+            const uint32_t entity = mGroundFollowers[i];
+            positions[entity].setY(mGroundHeights[i] + radii[entity]);
+            mTransforms.markChanged(entity);
+        }
+    });
+}
+
+void Renderer::drawPagedTerrain(VkCommandBuffer commandBuffer)
+{
+    if (!mPagedTerrain)
+        return;
+
+    setTexture(mObjects.at(1)->mTexturehandle.mTextureDescriptorSet != VK_NULL_HANDLE ? mObjects.at(1)->mTexturehandle : mDefaultTextureHandle, commandBuffer);
+    for (const PagedTerrain::Tile& tile : mPagedTerrain->getResidentTiles())
+    {
+        HeightMap* heightMap = tile.mesh.get();
+        if (heightMap->getVBuffer() == VK_NULL_HANDLE || heightMap->getIBuffer() == VK_NULL_HANDLE)
+            continue;
+        drawTerrainMesh(commandBuffer, heightMap, mCamera.projectionMatrix() * mCamera.viewMatrix() * heightMap->getMatrix());
+    }
+}
+
+void Renderer::releasePagedTerrainBuffers(HeightMap* tile)
+{
+    if (tile->getVBuffer()) {
+        destroyBuffer({ tile->getVBufferMemory(), tile->getVBuffer() });
+        tile->getVBuffer() = VK_NULL_HANDLE;
+    }
+    if (tile->getIBuffer()) {
+        destroyBuffer({ tile->getIBufferMemory(), tile->getIBuffer() });
+        tile->getIBuffer() = VK_NULL_HANDLE;
+    }
+}
+
+//Called on the render thread: the staging buffers are made here, and stay mapped while the worker writes into them
+void Renderer::startStreamedImport(const std::string& filename, VisualObject* sceneObject)
+{
+    auto import = std::make_unique<StreamedImport>();
+    import->inScene = sceneObject != nullptr;
+    import->object = sceneObject ? sceneObject : new VisualObject();
+    if (!sceneObject)
+    {
+        import->object->setName(filename);
+        import->object->setStreamedFile(filename);
+    }
+    for (int c = 0; c < StreamedImport::kStagingChunks; c++)
+    {
+        import->staging[c] = createGeneralBuffer(StreamedImport::kChunkSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        void* data{ nullptr };
+        mDeviceFunctions->vkMapMemory(mWindow->device(), import->staging[c].mBufferMemory, 0, StreamedImport::kChunkSize, 0, &data);
+        import->stagingMemory[c] = static_cast<char*>(data);
+    }
+
+    StreamedImport* sink = import.get();
+    import->worker = std::thread([sink, filename]() { ObjectMesh::streamObjFile(filename, *sink); });
+    mStreamedImports.push_back(std::move(import));
+}
+
+//Copies the chunks the workers have filled since last frame to the GPU buffers,
+//and adds the objects that are completely uploaded to the scene
+void Renderer::uploadStreamedImports()
+{
+    const VkDeviceSize uniAlign = mWindow->physicalDeviceProperties()->limits.minUniformBufferOffsetAlignment;
+    for (auto it = mStreamedImports.begin(); it != mStreamedImports.end();)
+    {
+        StreamedImport& import = **it;
+        std::vector<int> filledChunks;
+        bool sizesKnown, finished, ok;
+        {
+            std::lock_guard<std::mutex> lock(import.mutex);
+            filledChunks.swap(import.filledChunks);
+            sizesKnown = import.sizesKnown;
+            finished = import.finished;
+            ok = import.ok;
+        }
+
+        //The GPU buffers can be made as soon as the first pass over the file has counted the faces
+        if (sizesKnown && import.vertexBuffer.mBuffer == VK_NULL_HANDLE)
+        {
+            import.vertexBuffer = createGeneralBuffer(aligned(import.maxVertexCount * sizeof(Vertex), uniAlign),
+                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+            import.indexBuffer = createGeneralBuffer(aligned(import.indexCount * sizeof(uint32_t), uniAlign),
+                VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        }
+
+        if (!filledChunks.empty())
+        {
+            VkCommandBuffer commandBuffer = beginTransientCommandBuffer();
+            for (int c : filledChunks)
+            {
+                VkBufferCopy vertexRegion{ 0, import.uploadedVertexCount * sizeof(Vertex), import.chunkVertexCount[c] * sizeof(Vertex) };
+                VkBufferCopy indexRegion{ StreamedImport::kIndexOffset, import.uploadedIndexCount * sizeof(uint32_t), import.chunkIndexCount[c] * sizeof(uint32_t) };
+                if (vertexRegion.size > 0)
+                    mDeviceFunctions->vkCmdCopyBuffer(commandBuffer, import.staging[c].mBuffer, import.vertexBuffer.mBuffer, 1, &vertexRegion);
+                if (indexRegion.size > 0)
+                    mDeviceFunctions->vkCmdCopyBuffer(commandBuffer, import.staging[c].mBuffer, import.indexBuffer.mBuffer, 1, &indexRegion);
+                import.uploadedVertexCount += import.chunkVertexCount[c];
+                import.uploadedIndexCount += import.chunkIndexCount[c];
+            }
+            endTransientCommandBuffer(commandBuffer);   //waits for the copies, so the chunks can be written again
+
+            {
+                std::lock_guard<std::mutex> lock(import.mutex);
+                for (int c : filledChunks)
+                    import.chunkBusy[c] = false;
+            }
+            import.chunkFreed.notify_all();
+        }
+
+        if (!finished)
+        {
+            ++it;
+            continue;
+        }
+
+        //finished is set after the last chunk is queued, so everything is uploaded now
+        import.worker.join();
+        for (int c = 0; c < StreamedImport::kStagingChunks; c++)
+        {
+            mDeviceFunctions->vkUnmapMemory(mWindow->device(), import.staging[c].mBufferMemory);
+            destroyBuffer(import.staging[c]);
+        }
+
+        VisualObject* object = import.object;
+        if (ok && import.uploadedIndexCount > 0)
+        {
+            object->setVBuffer(import.vertexBuffer.mBuffer);
+            object->setVBufferMemory(import.vertexBuffer.mBufferMemory);
+            object->setIBuffer(import.indexBuffer.mBuffer);
+            object->setIBufferMemory(import.indexBuffer.mBufferMemory);
+            object->setStreamedCounts(import.uploadedVertexCount, import.uploadedIndexCount);
+            if (!import.inScene)
+            {
+                mObjects.push_back(object);
+                mTransforms.add(object);
+                mMap.insert(std::pair<std::string, VisualObject*>{object->getName(), object});
+            }
+            qDebug() << "Imported" << object->getName().c_str() << "-" << import.uploadedIndexCount / 3 << "triangles streamed to the GPU";
+        }
+        else
+        {
+            qDebug() << "Streamed import of" << object->getName().c_str() << "failed";
+            if (import.vertexBuffer.mBuffer != VK_NULL_HANDLE)
+            {
+                destroyBuffer(import.vertexBuffer);
+                destroyBuffer(import.indexBuffer);
+            }
+            if (import.inScene)
+                removeObject(object);
+            delete object;
+        }
+        it = mStreamedImports.erase(it);
+    }
+}
+
+//Stops the streamed imports that are not done, and frees what they have uploaded so far
+void Renderer::cancelStreamedImports()
+{
+    for (std::unique_ptr<StreamedImport>& import : mStreamedImports)
+    {
+        import->cancel();
+        for (int c = 0; c < StreamedImport::kStagingChunks; c++)
+        {
+            mDeviceFunctions->vkUnmapMemory(mWindow->device(), import->staging[c].mBufferMemory);
+            destroyBuffer(import->staging[c]);
+        }
+        if (import->vertexBuffer.mBuffer != VK_NULL_HANDLE)
+        {
+            destroyBuffer(import->vertexBuffer);
+            destroyBuffer(import->indexBuffer);
+        }
+        //An object in the scene is streamed again by the next initResources()
+        if (!import->inScene)
+            delete import->object;
+    }
+    mStreamedImports.clear();
+}
+
+//Takes the object out of the scene, without deleting it. Its buffers must be released already
+void Renderer::removeObject(VisualObject* object)
+{
+    mObjects.erase(std::remove(mObjects.begin(), mObjects.end(), object), mObjects.end());
+    for (auto it = mMap.begin(); it != mMap.end();)
+        it = it->second == object ? mMap.erase(it) : std::next(it);
+    mTransforms.remove(object);
+    if (mVulkanWindow && mVulkanWindow->getSelectedObject() == object)
+        mVulkanWindow->setSelectedObject(mPlayer);
+}
+
 //Automatically called by Qt on Renderer startup
 void Renderer::initResources()
 {
@@ -74,10 +596,26 @@ void Renderer::initResources()
 	// Create correct buffers for all objects in mObjects with createBuffer() function
     for (auto it=mObjects.begin(); it!=mObjects.end(); it++)
     {
+        //The terrain mesh has its own vertex layout
+        HeightMap* heightMap = dynamic_cast<HeightMap*>(*it);
+        if (heightMap && !heightMap->getTerrainVertices().empty())
+        {
+            const std::vector<TerrainVertex>& terrainVertices = heightMap->getTerrainVertices();
+            createVertexBuffer(uniAlign, heightMap, terrainVertices.data(), terrainVertices.size() * sizeof(TerrainVertex));
+            createIndexBuffer(uniAlign, heightMap);
+            continue;
+        }
+        //Streamed meshes are not in memory - they are streamed from their file again, and drawn when that is done
+        if ((*it)->getVertices().empty())
+        {
+            if (!(*it)->getStreamedFile().empty())
+                startStreamedImport((*it)->getStreamedFile(), *it);
+            continue;
+        }
 		createVertexBuffer(uniAlign, *it);                //New version - more explicit to how Vulkan does it
 		//createBuffer(logicalDevice, uniAlign, *it);         //Old version 
 
-		if ((*it)->getIndices().size() > 0) //If object has indices
+		if (!(*it)->getIndices().empty()) //If object has indices
 			createIndexBuffer(uniAlign, *it);
     }
 
@@ -130,9 +668,10 @@ void Renderer::initResources()
     VkPushConstantRange pushConstantRange{};                //Updated to more common way to write it
     pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     pushConstantRange.offset = 0;
-    pushConstantRange.size = 16 * sizeof(float);            // 16 floats for the model matrix
+    pushConstantRange.size = sizeof(TerrainPushConstants);  // 16 floats for the model matrix - and the terrain and node parameters in terrain.vert
 
-	std::array<VkDescriptorSetLayout, 2> descriptorSetLayouts = { mDescriptorSetLayout, mTextureDescriptorSetLayout };
+	//Set 2 is the height texture of the displaced terrain, only used by mTerrainPipeline
+	std::array<VkDescriptorSetLayout, 3> descriptorSetLayouts = { mDescriptorSetLayout, mTextureDescriptorSetLayout, mTextureDescriptorSetLayout };
 
     VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -209,7 +748,7 @@ void Renderer::initResources()
     VkPipelineRasterizationStateCreateInfo rasterization{};
     rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
     rasterization.polygonMode = VK_POLYGON_MODE_FILL;           // VK_POLYGON_MODE_LINE will make a wireframe;
-    rasterization.cullMode = VK_CULL_MODE_NONE;                 // VK_CULL_MODE_BACK_BIT will cull backsides
+    rasterization.cullMode = kMeshCullMode;                     // VK_CULL_MODE_BACK_BIT will cull backsides
 	rasterization.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;  // Front face is counter clockwise - could be clockwise with VK_FRONT_FACE_CLOCKWISE
     rasterization.lineWidth = 1.0f;                             // Not important for VK_POLYGON_MODE_FILL
     pipelineInfo.pRasterizationState = &rasterization;
@@ -256,6 +795,69 @@ void Renderer::initResources()
     if (result != VK_SUCCESS)
         qFatal("Failed to create graphics pipeline: %d", result);
 
+    //Pipeline for the displaced terrain - the same as the first, with terrain.vert reading only the patch positions
+    VkShaderModule terrainShaderModule = createShader(QStringLiteral(":/terrain_vert.spv"));
+    VkPipelineShaderStageCreateInfo shaderStagesTerrain[] = { vertShaderCreateInfoT, fragShaderCreateInfoT };
+    shaderStagesTerrain[0].module = terrainShaderModule;
+
+    VkVertexInputBindingDescription terrainBindingDesc{};
+    terrainBindingDesc.binding = 0;
+    terrainBindingDesc.stride = 2 * sizeof(float);
+    terrainBindingDesc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+    VkVertexInputAttributeDescription terrainAttrDesc{};
+    terrainAttrDesc.location = 0;       //position in the patch
+    terrainAttrDesc.binding = 0;
+    terrainAttrDesc.format = VK_FORMAT_R32G32_SFLOAT;
+    terrainAttrDesc.offset = 0;
+
+    VkPipelineVertexInputStateCreateInfo terrainVertexInputInfo = vertexInputInfo;
+    terrainVertexInputInfo.pVertexBindingDescriptions = &terrainBindingDesc;
+    terrainVertexInputInfo.vertexAttributeDescriptionCount = 1;
+    terrainVertexInputInfo.pVertexAttributeDescriptions = &terrainAttrDesc;
+
+    pipelineInfo.pStages = shaderStagesTerrain;
+    pipelineInfo.pVertexInputState = &terrainVertexInputInfo;
+    result = mDeviceFunctions->vkCreateGraphicsPipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mTerrainPipeline);
+    if (result != VK_SUCCESS)
+        qFatal("Failed to create graphics pipeline: %d", result);
+
+    //Pipeline for the terrain mesh - terrainmesh.vert with the 4 byte TerrainVertex
+    VkShaderModule terrainMeshShaderModule = createShader(QStringLiteral(":/terrainmesh_vert.spv"));
+    shaderStagesTerrain[0].module = terrainMeshShaderModule;
+
+    terrainBindingDesc.stride = sizeof(TerrainVertex);
+
+    VkVertexInputAttributeDescription terrainMeshAttrDesc[2]{};
+    terrainMeshAttrDesc[0].location = 0;    //height sample
+    terrainMeshAttrDesc[0].binding = 0;
+    terrainMeshAttrDesc[0].format = VK_FORMAT_R16_UINT;
+    terrainMeshAttrDesc[0].offset = offsetof(TerrainVertex, height);
+    terrainMeshAttrDesc[1].location = 1;    //x and z of the normal, -1 to 1
+    terrainMeshAttrDesc[1].binding = 0;
+    terrainMeshAttrDesc[1].format = VK_FORMAT_R8G8_SNORM;
+    terrainMeshAttrDesc[1].offset = offsetof(TerrainVertex, normalX);
+
+    terrainVertexInputInfo.vertexAttributeDescriptionCount = 2;
+    terrainVertexInputInfo.pVertexAttributeDescriptions = terrainMeshAttrDesc;
+    result = mDeviceFunctions->vkCreateGraphicsPipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mTerrainMeshPipeline);
+    if (result != VK_SUCCESS)
+        qFatal("Failed to create graphics pipeline: %d", result);
+
+    //The same for the terrain mesh as triangle strips, where HeightMap::kPrimitiveRestart starts a new strip
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+    inputAssembly.primitiveRestartEnable = VK_TRUE;
+    result = mDeviceFunctions->vkCreateGraphicsPipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mTerrainMeshStripPipeline);
+    if (result != VK_SUCCESS)
+        qFatal("Failed to create graphics pipeline: %d", result);
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    inputAssembly.primitiveRestartEnable = VK_FALSE;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    if (terrainShaderModule)
+        mDeviceFunctions->vkDestroyShaderModule(logicalDevice, terrainShaderModule, nullptr);
+    if (terrainMeshShaderModule)
+        mDeviceFunctions->vkDestroyShaderModule(logicalDevice, terrainMeshShaderModule, nullptr);
+
 	//Making a pipeline for drawing lines
 	mColorMaterial.pipeline = mPipeline1;                       // reusing most of the settings from the first pipeline
     inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST;   // draw lines
@@ -290,6 +892,17 @@ void Renderer::initResources()
     mDefaultTextureHandle = createTexture("../../Assets/defaultTexture.jpg");
     mObjects.at(1)->mTexturehandle = createTexture("../../Assets/Hund.bmp");
 
+    //Height textures for the displaced terrains, and the patch they all are drawn with
+    for (VisualObject* visualObject : mObjects)
+    {
+        HeightMap* heightMap = dynamic_cast<HeightMap*>(visualObject);
+        if (!heightMap || !heightMap->isDisplaced())
+            continue;
+        heightMap->mHeightTextureHandle = createHeightTexture(heightMap);
+        if (mTerrainPatchIndexCount == 0)
+            createTerrainPatch();
+    }
+
     // getVulkanHWInfo(); // if you want to get info about the Vulkan hardware
 }
 
@@ -313,21 +926,25 @@ void Renderer::initSwapChainResources()
 
 void Renderer::startNextFrame()
 {
+    //Objects imported since last frame joins the scene here, between two frames
+    addPendingObjects();
+    updatePagedTerrain();
+
     //Handeling input from keyboard and mouse is done in VulkanWindow
     //Has to be done each frame to get smooth movement
     mVulkanWindow->handleInput();
     mCamera.update();               //input can have moved the camera
 
-    //Making it so the player moves on the terrain
-    auto* terrain = static_cast<HeightMap*>(mObjects.at(1));
-    QVector3D newPos = mPlayer->getMatrix().column(3).toVector3D();
-
-    newPos.setY(terrain->getHeightAt(newPos) + mPlayer->radius);
-    mPlayer->setPosition(newPos);
+    //Making it so the player, and the other objects following the terrain, move on the terrain
+    clampToGround();
 
     if(mVulkanWindow->getSelectedObject()->getName() == "Player")
         mCamera.FollowTarget(mPlayer, mCamera.CameraOffsetToTarget);
 
+    //The world matrices of the objects that moved, and which objects the camera can see
+    mTransforms.updateWorldMatrices();
+    mTransforms.cull(Frustum(mCamera.projectionMatrix() * mCamera.viewMatrix()), mVisibleEntities);
+
     /*
     onCollision(mPlayer);
     onCollisionEnd(mPlayer);
@@ -360,6 +977,9 @@ void Renderer::startNextFrame()
         }
     }
     */
+    //Recording the draw calls should make no heap allocations - what it needs is kept between the frames
+    const uint64_t allocationsBefore = heapAllocationCount();
+
     VkCommandBuffer commandBuffer = mWindow->currentCommandBuffer();
 
 	setRenderPassParameters(commandBuffer);
@@ -371,9 +991,34 @@ void Renderer::startNextFrame()
 
     setViewProjectionMatrix();   //Update the view and projection matrix in the Uniform
 
+    //For level of detail: pixels covered by one world unit at distance 1 from the camera
+    const float pixelsPerUnitAtDistance1 = mWindow->swapChainImageSize().height() * 0.5f * mCamera.projectionMatrix()(1, 1);
+
     /********************************* Our draw call!: *********************************/
     for (std::vector<VisualObject*>::iterator it=mObjects.begin(); it!=mObjects.end(); it++)
     {
+        //The terrains have pipelines of their own - the displaced terrain has no vertex buffer,
+        //and the terrain mesh has the TerrainVertex
+        HeightMap* terrainObject = dynamic_cast<HeightMap*>(*it);
+        if (terrainObject && terrainObject->isDisplaced())
+        {
+            if (terrainObject->mHeightTextureHandle.mTextureDescriptorSet != VK_NULL_HANDLE)
+                drawDisplacedTerrain(commandBuffer, terrainObject, mCamera.projectionMatrix() * mCamera.viewMatrix() * (*it)->getMatrix());
+            continue;
+        }
+        if (terrainObject && !terrainObject->getTerrainVertices().empty())
+        {
+            if (terrainObject->getVBuffer() == VK_NULL_HANDLE)
+                continue;
+            setTexture(terrainObject->mTexturehandle.mTextureDescriptorSet != VK_NULL_HANDLE ? terrainObject->mTexturehandle : mDefaultTextureHandle, commandBuffer);
+            drawTerrainMesh(commandBuffer, terrainObject, mCamera.projectionMatrix() * mCamera.viewMatrix() * (*it)->getMatrix());
+            continue;
+        }
+
+        if ((*it)->getVBuffer() == VK_NULL_HANDLE)  //a streamed mesh being streamed again after releaseResources()
+            continue;
+        if (!mVisibleEntities[(*it)->getEntity()])   //outside the frustum
+            continue;
 
         //Draw type
 		if ((*it)->getDrawType() == 0)
@@ -394,16 +1039,35 @@ void Renderer::startNextFrame()
 
         mDeviceFunctions->vkCmdBindVertexBuffers(commandBuffer, 0, 1, &(*it)->getVBuffer(), &vbOffset);
 		//Check if we have an index buffer - if so, use Indexed draw
-        if ((*it)->getIndices().size() > 0)
+        if ((*it)->getIndexCount() > 0)
         {
+            //Level of detail from how big the object is on screen
+            const QMatrix4x4 modelView = mCamera.viewMatrix() * (*it)->getMatrix();
+            const float distance = modelView.map((*it)->getBoundingCenter()).length();
+            const float scale = (*it)->getMatrix().column(0).toVector3D().length();
+            LodLevel lod{ 0, static_cast<uint32_t>((*it)->getIndexCount()), 0.f };
+            if (distance > (*it)->getBoundingRadius() * scale)   //not inside the object
+                lod = (*it)->selectLod(pixelsPerUnitAtDistance1 * scale / distance);
+
 			mDeviceFunctions->vkCmdBindIndexBuffer(commandBuffer, (*it)->getIBuffer(), 0, VK_INDEX_TYPE_UINT32);
-			mDeviceFunctions->vkCmdDrawIndexed(commandBuffer, (*it)->getIndices().size(), 1, 0, 0, 0); //size == number of indices
+            if (lod.firstIndex == 0 && !(*it)->getMeshlets().empty())
+                drawVisibleMeshlets(commandBuffer, *it, mvp);
+            else
+                mDeviceFunctions->vkCmdDrawIndexed(commandBuffer, lod.indexCount, 1, lod.firstIndex, 0, 0);
 		}
 		else   //No index buffer - use regular draw
-			mDeviceFunctions->vkCmdDraw(commandBuffer, (*it)->getVertices().size(), 1, 0, 0);   
+			mDeviceFunctions->vkCmdDraw(commandBuffer, (*it)->getVertexCount(), 1, 0, 0);   
     }
+    drawPagedTerrain(commandBuffer);
     /***************************************/
 
+    //The first frames can allocate while the containers kept between the frames grow
+    //Only warn when the count changes, else the same warning would be written every frame
+    const uint64_t lastAllocations = mDrawRecordingAllocations;
+    mDrawRecordingAllocations = heapAllocationCount() - allocationsBefore;
+    if (mDrawRecordingAllocations > 0 && mDrawRecordingAllocations != lastAllocations)
+        qWarning("Recording the draw calls made %llu heap allocations", static_cast<unsigned long long>(mDrawRecordingAllocations));
+
     mDeviceFunctions->vkCmdEndRenderPass(commandBuffer);
     
     mWindow->frameReady();
@@ -474,6 +1138,131 @@ void Renderer::setTexture(TextureHandle& textureHandle, VkCommandBuffer commandB
         mPipelineLayout, 1, 1, &textureHandle.mTextureDescriptorSet, 0, nullptr);	
 }
 
+void Renderer::drawVisibleMeshlets(VkCommandBuffer commandBuffer, VisualObject* visualObject, const QMatrix4x4& modelViewProjection)
+{
+    //Frustum and camera in the coordinate system of the object, so the meshlet bounds can be used as they are
+    const Frustum frustum(modelViewProjection);
+    const QVector3D cameraPosition = (mCamera.viewMatrix() * visualObject->getMatrix()).inverted().map(QVector3D(0.f, 0.f, 0.f));
+    //Meshlets seen from behind are only skipped if the pipeline would not have drawn their triangles anyway
+    constexpr bool cullsBackfaces = (kMeshCullMode & VK_CULL_MODE_BACK_BIT) != 0;
+
+    //Meshlets next to each other in the index buffer that are both visible are drawn with one call
+    uint32_t firstIndex{ 0 };
+    uint32_t indexCount{ 0 };
+    for (const Meshlet& meshlet : visualObject->getMeshlets())
+    {
+        const bool visible = frustum.intersectsSphere(meshlet.center, meshlet.radius) && !(cullsBackfaces && meshlet.isBackfacing(cameraPosition));
+        if (visible && indexCount > 0 && firstIndex + indexCount == meshlet.firstIndex)
+        {
+            indexCount += meshlet.indexCount;
+            continue;
+        }
+        if (indexCount > 0)
+            mDeviceFunctions->vkCmdDrawIndexed(commandBuffer, indexCount, 1, firstIndex, 0, 0);
+        firstIndex = meshlet.firstIndex;
+        indexCount = visible ? meshlet.indexCount : 0;
+    }
+    if (indexCount > 0)
+        mDeviceFunctions->vkCmdDrawIndexed(commandBuffer, indexCount, 1, firstIndex, 0, 0);
+}
+
+void Renderer::drawVisibleChunks(VkCommandBuffer commandBuffer, const HeightMap* heightMap, const QMatrix4x4& modelViewProjection)
+{
+    //Frustum in the coordinate system of the terrain, so the chunk boxes can be used as they are
+    const Frustum frustum(modelViewProjection);
+
+    //Chunks next to each other in the index buffer that are both visible are drawn with one call
+    uint32_t firstIndex{ 0 };
+    uint32_t indexCount{ 0 };
+    for (const TerrainChunk& chunk : heightMap->getChunks())
+    {
+        const bool visible = frustum.intersectsBox(chunk.boundsMin, chunk.boundsMax);
+        if (visible && indexCount > 0 && firstIndex + indexCount == chunk.firstIndex)
+        {
+            indexCount += chunk.indexCount;
+            continue;
+        }
+        if (indexCount > 0)
+            mDeviceFunctions->vkCmdDrawIndexed(commandBuffer, indexCount, 1, firstIndex, 0, 0);
+        firstIndex = chunk.firstIndex;
+        indexCount = visible ? chunk.indexCount : 0;
+    }
+    if (indexCount > 0)
+        mDeviceFunctions->vkCmdDrawIndexed(commandBuffer, indexCount, 1, firstIndex, 0, 0);
+}
+
+void Renderer::drawTerrainMesh(VkCommandBuffer commandBuffer, HeightMap* heightMap, const QMatrix4x4& modelViewProjection)
+{
+    mDeviceFunctions->vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+        heightMap->usesTriangleStrips() ? mTerrainMeshStripPipeline : mTerrainMeshPipeline);
+
+    //Only up to the node part is read by terrainmesh.vert
+    const TerrainPushConstants pushConstants = terrainPushConstants(heightMap, heightMap->getHeightScale());
+    mDeviceFunctions->vkCmdPushConstants(commandBuffer, mPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+        offsetof(TerrainPushConstants, cameraX), &pushConstants);
+
+    VkDeviceSize vbOffset{ 0 };
+    mDeviceFunctions->vkCmdBindVertexBuffers(commandBuffer, 0, 1, &heightMap->getVBuffer(), &vbOffset);
+    mDeviceFunctions->vkCmdBindIndexBuffer(commandBuffer, heightMap->getIBuffer(), 0, VK_INDEX_TYPE_UINT32);
+    drawVisibleChunks(commandBuffer, heightMap, modelViewProjection);
+}
+
+void Renderer::drawDisplacedTerrain(VkCommandBuffer commandBuffer, HeightMap* heightMap, const QMatrix4x4& modelViewProjection)
+{
+    mDeviceFunctions->vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mTerrainPipeline);
+
+    //The R8 or R16 texture reads 0 to 1
+    const float largestSample = static_cast<float>((1 << heightMap->getSampleBits()) - 1);
+    TerrainPushConstants pushConstants = terrainPushConstants(heightMap, heightMap->getHeightScale() * largestSample);
+
+    //The level of detail from the camera, in the coordinates of the terrain
+    const QVector3D cameraPosition = (mCamera.viewMatrix() * heightMap->getMatrix()).inverted().map(QVector3D(0.f, 0.f, 0.f));
+    pushConstants.cameraX = cameraPosition.x();
+    pushConstants.cameraY = cameraPosition.y();
+    pushConstants.cameraZ = cameraPosition.z();
+    heightMap->selectLod(cameraPosition, Frustum(modelViewProjection), mTerrainLodSelection);
+    if (mTerrainLodSelection.empty())
+        return;
+
+    mDeviceFunctions->vkCmdPushConstants(commandBuffer, mPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(pushConstants), &pushConstants);
+
+    setTexture(heightMap->mTexturehandle.mTextureDescriptorSet != VK_NULL_HANDLE ? heightMap->mTexturehandle : mDefaultTextureHandle, commandBuffer);
+    mDeviceFunctions->vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+        mPipelineLayout, 2, 1, &heightMap->mHeightTextureHandle.mTextureDescriptorSet, 0, nullptr);
+
+    VkDeviceSize vbOffset{ 0 };
+    mDeviceFunctions->vkCmdBindVertexBuffers(commandBuffer, 0, 1, &mTerrainPatchVertexBuffer.mBuffer, &vbOffset);
+    mDeviceFunctions->vkCmdBindIndexBuffer(commandBuffer, mTerrainPatchIndexBuffer.mBuffer, 0, VK_INDEX_TYPE_UINT32);
+
+    //The quadrants of the patch are after each other in the index buffer, so the quadrants to draw
+    //of a node that are next to each other are drawn with one call
+    const uint32_t quadrantIndexCount = mTerrainPatchIndexCount / 4;
+    const std::vector<TerrainLodNode>& nodes = heightMap->getLodNodes();
+    constexpr uint32_t kNodeOffset = offsetof(TerrainPushConstants, nodeStartW);
+    for (const TerrainLodSelection& selected : mTerrainLodSelection)
+    {
+        const TerrainLodNode& node = nodes[selected.node];
+        pushConstants.nodeStartW = node.startW;
+        pushConstants.nodeStartD = node.startD;
+        pushConstants.nodeStride = 1 << node.level;
+        pushConstants.morphStart = selected.morphStart;
+        pushConstants.morphEnd = selected.morphEnd;
+        mDeviceFunctions->vkCmdPushConstants(commandBuffer, mPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, kNodeOffset,
+            sizeof(pushConstants) - kNodeOffset, reinterpret_cast<const char*>(&pushConstants) + kNodeOffset);
+
+        for (uint32_t q = 0; q < 4; q++)
+        {
+            if ((selected.quadrants & (1u << q)) == 0)
+                continue;
+            uint32_t quadrantCount{ 1 };
+            while (q + quadrantCount < 4 && (selected.quadrants & (1u << (q + quadrantCount))))
+                quadrantCount++;
+            mDeviceFunctions->vkCmdDrawIndexed(commandBuffer, quadrantCount * quadrantIndexCount, 1, q * quadrantIndexCount, 0, 0);
+            q += quadrantCount - 1;
+        }
+    }
+}
+
 void Renderer::setRenderPassParameters(VkCommandBuffer commandBuffer)
 {
     const QSize swapChainImageSize = mWindow->swapChainImageSize();
@@ -564,9 +1353,15 @@ void Renderer::createBuffer(VkDevice logicalDevice, const VkDeviceSize uniformAl
 //Also the generation of the buffer is in a separate function
 //and copy data to GPU read only memory
 void Renderer::createVertexBuffer(const VkDeviceSize uniformAlignment, VisualObject* visualObject)
+{
+    const std::vector<Vertex>& vertices = visualObject->getVertices();
+    createVertexBuffer(uniformAlignment, visualObject, vertices.data(), vertices.size() * sizeof(Vertex));
+}
+
+void Renderer::createVertexBuffer(const VkDeviceSize uniformAlignment, VisualObject* visualObject, const void* vertexData, VkDeviceSize vertexSize)
 {
     //Get the size of the mesh and align it to the uniform alignment
-    VkDeviceSize vertexAllocSize = aligned(visualObject->getVertices().size() * sizeof(Vertex), uniformAlignment);
+    VkDeviceSize vertexAllocSize = aligned(vertexSize, uniformAlignment);
 
 	BufferHandle stagingHandle = createGeneralBuffer(vertexAllocSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, //Transfer source bit is for copying data to the GPU
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);    // Host visible memory (CPU) is slower to access than device local memory (GPU)
@@ -574,7 +1369,7 @@ void Renderer::createVertexBuffer(const VkDeviceSize uniformAlignment, VisualObj
     //Copy the data over to the buffer
     void* data{ nullptr };
     mDeviceFunctions->vkMapMemory(mWindow->device(), stagingHandle.mBufferMemory, 0, vertexAllocSize, 0, &data);
-    memcpy(data, visualObject->getVertices().data(), vertexAllocSize);
+    memcpy(data, vertexData, vertexSize);
     mDeviceFunctions->vkUnmapMemory(mWindow->device(), stagingHandle.mBufferMemory);
 
 	//This is for copying the data to the GPU
@@ -600,8 +1395,14 @@ void Renderer::createVertexBuffer(const VkDeviceSize uniformAlignment, VisualObj
 
 void Renderer::createIndexBuffer(const VkDeviceSize uniformAlignment, VisualObject* visualObject)
 {
+	//The full mesh first, then the levels of detail
+	const std::vector<uint32_t>& indices = visualObject->getIndices();
+	const std::vector<uint32_t>& lodIndices = visualObject->getLodIndices();
+	const VkDeviceSize indexSize = indices.size() * sizeof(uint32_t);
+	const VkDeviceSize lodIndexSize = lodIndices.size() * sizeof(uint32_t);
+
 	//Get the size of the mesh and align it to the uniform alignment
-	VkDeviceSize indexAllocSize = aligned(visualObject->getIndices().size() * sizeof(uint32_t), uniformAlignment);
+	VkDeviceSize indexAllocSize = aligned(indexSize + lodIndexSize, uniformAlignment);
 
 	//Create a staging buffer for the index data
 	BufferHandle stagingHandle = createGeneralBuffer(indexAllocSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
@@ -609,7 +1410,8 @@ void Renderer::createIndexBuffer(const VkDeviceSize uniformAlignment, VisualObje
 	
     void* data{ nullptr };
 	mDeviceFunctions->vkMapMemory(mWindow->device(), stagingHandle.mBufferMemory, 0, indexAllocSize, 0, &data);
-	memcpy(data, visualObject->getIndices().data(), indexAllocSize);
+	memcpy(data, indices.data(), indexSize);
+	memcpy(static_cast<char*>(data) + indexSize, lodIndices.data(), lodIndexSize);
 	mDeviceFunctions->vkUnmapMemory(mWindow->device(), stagingHandle.mBufferMemory);
 
     //This is for copying the data to the GPU
@@ -696,7 +1498,7 @@ void Renderer::createDescriptorSetLayouts()
     textureLayoutBinding.binding = 0;
     textureLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     textureLayoutBinding.descriptorCount = 1;
-    textureLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;   //We are using the uniform buffer in the vertex shader
+    textureLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;   //terrain.vert reads the height texture
 
     VkDescriptorSetLayoutCreateInfo textureLayoutInfo{};
     textureLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -868,11 +1670,28 @@ void Renderer::releaseResources()
 
     VkDevice dev = mWindow->device();
 
+    cancelStreamedImports();
+
     if (mPipeline1) {
         mDeviceFunctions->vkDestroyPipeline(dev, mPipeline1, nullptr);
         mPipeline1 = VK_NULL_HANDLE;
     }
 
+    if (mTerrainPipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mTerrainPipeline, nullptr);
+        mTerrainPipeline = VK_NULL_HANDLE;
+    }
+
+    if (mTerrainMeshPipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mTerrainMeshPipeline, nullptr);
+        mTerrainMeshPipeline = VK_NULL_HANDLE;
+    }
+
+    if (mTerrainMeshStripPipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mTerrainMeshStripPipeline, nullptr);
+        mTerrainMeshStripPipeline = VK_NULL_HANDLE;
+    }
+
     if (mColorMaterial.pipeline) {
         mDeviceFunctions->vkDestroyPipeline(dev, mColorMaterial.pipeline, nullptr);
         mColorMaterial.pipeline = VK_NULL_HANDLE;
@@ -914,11 +1733,27 @@ void Renderer::releaseResources()
         }
     }
 
+    if (mPagedTerrain) {
+        for (const PagedTerrain::Tile& tile : mPagedTerrain->getResidentTiles())
+            releasePagedTerrainBuffers(tile.mesh.get());
+    }
+
+    destroyBuffer(mTerrainPatchVertexBuffer);
+    destroyBuffer(mTerrainPatchIndexBuffer);
+    mTerrainPatchVertexBuffer = {};
+    mTerrainPatchIndexBuffer = {};
+    mTerrainPatchIndexCount = 0;
+
     // Destroy textures
     destroyTexture(mDefaultTextureHandle);
     for(auto it = mObjects.begin(); it != mObjects.end();++it)
     {
         destroyTexture((*it)->mTexturehandle);
+        if (HeightMap* heightMap = dynamic_cast<HeightMap*>(*it); heightMap && heightMap->isDisplaced())
+        {
+            destroyTexture(heightMap->mHeightTextureHandle);
+            heightMap->mHeightTextureHandle = {};
+        }
     }
 
 	if (mTextureSampler) {
@@ -1126,7 +1961,68 @@ TextureHandle Renderer::createTexture(const char* filename)
     transitionImageLayout(textureHandle.mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
 	textureHandle.mImageView = createImageView(textureHandle.mImage, format);
+    createTextureDescriptorSet(textureHandle);
+	
+    destroyBuffer(stagingBuffer);
+
+	stbi_image_free(pixelData);
+
+	return textureHandle;
+}
+
+TextureHandle Renderer::createHeightTexture(const HeightMap* heightMap)
+{
+    const std::vector<uint16_t>& samples = heightMap->getHeightSamples();
+    //The values as they are - not SRGB. R16_UNORM is not required for sampling by Vulkan, but all desktop GPUs have it
+    VkFormat format{ heightMap->getSampleBits() == 16 ? VK_FORMAT_R16_UNORM : VK_FORMAT_R8_UNORM };
+    if (format == VK_FORMAT_R16_UNORM)
+    {
+        VkFormatProperties formatProperties{};
+        mWindow->vulkanInstance()->functions()->vkGetPhysicalDeviceFormatProperties(mWindow->physicalDevice(), format, &formatProperties);
+        if ((formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) == 0)
+        {
+            qWarning("R16 height textures are not supported - using the top 8 bits");
+            format = VK_FORMAT_R8_UNORM;
+        }
+    }
+    const size_t sampleSize = format == VK_FORMAT_R16_UNORM ? 2 : 1;
+    const VkDeviceSize imageSize = samples.size() * sampleSize;
+
+    BufferHandle stagingBuffer = createGeneralBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    void* data{};
+    mDeviceFunctions->vkMapMemory(mWindow->device(), stagingBuffer.mBufferMemory, 0, imageSize, 0, &data);
+    if (sampleSize == 2)
+        memcpy(data, samples.data(), imageSize);
+    else    //8 bit samples, or the top 8 bits of 16 bit samples
+    {
+        const int shift = heightMap->getSampleBits() - 8;
+        uint8_t* bytes = static_cast<uint8_t*>(data);
+        for (size_t i = 0; i < samples.size(); i++)
+            bytes[i] = static_cast<uint8_t>(samples[i] >> shift);
+    }
+    mDeviceFunctions->vkUnmapMemory(mWindow->device(), stagingBuffer.mBufferMemory);
+
+    TextureHandle textureHandle = createImage(heightMap->getGridWidth(), heightMap->getGridDepth(),
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, format);
+
+    transitionImageLayout(textureHandle.mImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    copyBufferToImage(stagingBuffer.mBuffer, textureHandle.mImage, heightMap->getGridWidth(), heightMap->getGridDepth());
+    transitionImageLayout(textureHandle.mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    textureHandle.mImageView = createImageView(textureHandle.mImage, format);
+    createTextureDescriptorSet(textureHandle);
+
+    destroyBuffer(stagingBuffer);
+
+    qDebug() << heightMap->getName().c_str() << "height texture" << heightMap->getGridWidth() << "x" << heightMap->getGridDepth()
+             << "-" << imageSize / 1024 << "kB on the GPU";
+    return textureHandle;
+}
 
+//Allocate a descriptor set for the texture from mTextureDescriptorPool, and point it to the image view
+void Renderer::createTextureDescriptorSet(TextureHandle& textureHandle)
+{
     VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
     descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     descriptorSetAllocateInfo.descriptorPool = mTextureDescriptorPool;
@@ -1153,12 +2049,67 @@ TextureHandle Renderer::createTexture(const char* filename)
     writeDescriptorSet.pImageInfo = &descriptorImageInfo;
 
     mDeviceFunctions->vkUpdateDescriptorSets(mWindow->device(), 1, &writeDescriptorSet, 0, nullptr);
-	
-    destroyBuffer(stagingBuffer);
+}
 
-	stbi_image_free(pixelData);
+void Renderer::createTerrainPatch()
+{
+    //The same quads and diagonals as HeightMap::makeTerrain(). The indices are one quadrant after the other,
+    //so a quadrant of a level of detail node can be drawn alone
+    constexpr int kSide{ HeightMap::kChunkQuads + 1 };
+    constexpr int kHalf{ HeightMap::kChunkQuads / 2 };
+    std::vector<float> vertices;
+    vertices.reserve(2 * kSide * kSide);
+    for (int d = 0; d < kSide; d++)
+    {
+        for (int w = 0; w < kSide; w++)
+        {
+            vertices.push_back(static_cast<float>(w));
+            vertices.push_back(static_cast<float>(d));
+        }
+    }
+    std::vector<uint32_t> indices;
+    indices.reserve(6 * HeightMap::kChunkQuads * HeightMap::kChunkQuads);
+    for (int q = 0; q < 4; q++)
+    {
+        const int quadrantW = (q & 1) * kHalf;
+        const int quadrantD = (q >> 1) * kHalf;
+        for (int d = quadrantD; d < quadrantD + kHalf; d++)
+        {
+            for (int w = quadrantW; w < quadrantW + kHalf; w++)
+            {
+                const uint32_t corner = w + d * kSide;
+                indices.insert(indices.end(), { corner, corner + kSide + 1, corner + kSide, corner, corner + 1, corner + kSide + 1 });
+            }
+        }
+    }
+    mTerrainPatchIndexCount = static_cast<uint32_t>(indices.size());
 
-	return textureHandle;
+    //Staging buffer with both, copied to the two GPU buffers
+    const VkDeviceSize vertexSize = vertices.size() * sizeof(float);
+    const VkDeviceSize indexSize = indices.size() * sizeof(uint32_t);
+    BufferHandle stagingHandle = createGeneralBuffer(vertexSize + indexSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    void* data{ nullptr };
+    mDeviceFunctions->vkMapMemory(mWindow->device(), stagingHandle.mBufferMemory, 0, vertexSize + indexSize, 0, &data);
+    memcpy(data, vertices.data(), vertexSize);
+    memcpy(static_cast<char*>(data) + vertexSize, indices.data(), indexSize);
+    mDeviceFunctions->vkUnmapMemory(mWindow->device(), stagingHandle.mBufferMemory);
+
+    mTerrainPatchVertexBuffer = createGeneralBuffer(vertexSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    mTerrainPatchIndexBuffer = createGeneralBuffer(indexSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VkCommandBuffer commandBuffer = beginTransientCommandBuffer();
+    VkBufferCopy copyRegion{};
+    copyRegion.size = vertexSize;
+    mDeviceFunctions->vkCmdCopyBuffer(commandBuffer, stagingHandle.mBuffer, mTerrainPatchVertexBuffer.mBuffer, 1, &copyRegion);
+    copyRegion.srcOffset = vertexSize;
+    copyRegion.size = indexSize;
+    mDeviceFunctions->vkCmdCopyBuffer(commandBuffer, stagingHandle.mBuffer, mTerrainPatchIndexBuffer.mBuffer, 1, &copyRegion);
+    endTransientCommandBuffer(commandBuffer);
+
+    destroyBuffer(stagingHandle);
 }
 
 TextureHandle Renderer::createImage(int width, int height, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkFormat format)
@@ -1308,37 +2259,27 @@ void Renderer::destroyTexture(TextureHandle& textureHandle)
 
 bool Renderer::overlapDetection(VisualObject* object, VisualObject* other) const
 {
-    float distBetweenObj = sqrt(
-        std::pow(object->getPosition().x() - object->getPosition().x(),2) +
-        std::pow(object->getPosition().y() - object->getPosition().y(),2) +
-        std::pow(object->getPosition().z() - object->getPosition().z(),2)
-        );
-
-    return distBetweenObj <= object->radius + other->radius;
-
+    return mTransforms.overlaps(object->getEntity(), other->getEntity());
 }
 
 void Renderer::onCollision(VisualObject* object)
 {
-    for(VisualObject* j : mObjects)
+    mTransforms.findOverlaps(object->getEntity(), mOverlappingEntities);
+    //Logged when the objects it collides with change, not every frame
+    if (mOverlappingEntities != mLastOverlappingEntities)
     {
-        if(&j != &mPlayer && overlapDetection(object,j) && j->enableCollision)
-        {
-             qDebug("Colliding with an object with collision set to true");
-        }
+        for (uint32_t entity : mOverlappingEntities)
+            qDebug() << "Colliding with entity" << entity << mTransforms.getOwner(entity)->getName().c_str();
+        mLastOverlappingEntities.swap(mOverlappingEntities);
     }
 }
 
 void Renderer::onCollisionEnd(VisualObject* object)
 {
-    for(VisualObject* j : mObjects)
+    const std::vector<uint8_t>& flags = mTransforms.getFlags();
+    for (uint32_t entity = 0; entity < flags.size(); entity++)
     {
-        if(&j != &mPlayer && !(overlapDetection(object,j)) && j->enableCollision)
-        {
-
+        if (entity != object->getEntity() && (flags[entity] & TransformStore::kCollides) && !mTransforms.overlaps(object->getEntity(), entity))
             qDebug("No longer colliding with an object");
-        }
     }
 }
-
-
@@ -4,15 +4,24 @@
 #include <QVulkanWindow>
 #include <vector>
 #include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <QVector2D>
 #include "Camera.h"
 #include "VisualObject.h"
 #include "Utilities.h"
+#include "TransformStore.h"
 
+class HeightMap;
+class PagedTerrain;
+struct TerrainLodSelection;
 
 class Renderer : public QVulkanWindowRenderer
 {
 public:
     Renderer(QVulkanWindow *w, bool msaa = false);
+    ~Renderer();
 
     //Initializes the Vulkan resources needed,
     // the buffers
@@ -37,8 +46,15 @@ public:
     void getVulkanHWInfo();
 
     std::vector<VisualObject*>& getObjects() { return mObjects; }
+    //Heap allocations made while recording the draw calls of the last frame (see AllocationCounter.h) - should be 0
+    uint64_t getDrawRecordingAllocations() const { return mDrawRecordingAllocations; }
     std::unordered_map<std::string, VisualObject*>& getMap() { return mMap; }
 
+    //Reads a mesh file on a worker thread. The new object gets its buffers and joins mObjects
+    //at the start of a later frame - the rendering keeps going while the file is read.
+    //Obj files of kStreamedImportBytes or more are streamed to the GPU instead of read into memory first
+    void importObjectAsync(const std::string& filename);
+
     //collision detection and overlap logic
     bool overlapDetection(VisualObject* object, VisualObject* other) const;
     void onCollision(VisualObject* object);
@@ -55,6 +71,15 @@ protected:
 
 	void setRenderPassParameters(VkCommandBuffer commandBuffer);
 
+    //Draws the meshlets of the object that are inside the frustum and not facing away from the camera
+    void drawVisibleMeshlets(VkCommandBuffer commandBuffer, VisualObject* visualObject, const QMatrix4x4& modelViewProjection);
+    //Draws the chunks of the terrain that are inside the frustum
+    void drawVisibleChunks(VkCommandBuffer commandBuffer, const HeightMap* heightMap, const QMatrix4x4& modelViewProjection);
+    //Draws the displaced terrain: the shared patch once for each level of detail node inside the frustum
+    void drawDisplacedTerrain(VkCommandBuffer commandBuffer, HeightMap* heightMap, const QMatrix4x4& modelViewProjection);
+    //Draws the chunks inside the frustum of a terrain mesh with mTerrainMeshPipeline, or mTerrainMeshStripPipeline for triangle strips. The texture must be set
+    void drawTerrainMesh(VkCommandBuffer commandBuffer, HeightMap* heightMap, const QMatrix4x4& modelViewProjection);
+
     //The ModelViewProjection MVP matrix
     QMatrix4x4 mProjectionMatrix;
     //Rotation angle of the triangle
@@ -81,6 +106,9 @@ protected:
     VkPipelineLayout mPipelineLayout{ VK_NULL_HANDLE };
     VkPipeline mPipeline1{ VK_NULL_HANDLE };
     VkPipeline mPipeline2{ VK_NULL_HANDLE };
+    VkPipeline mTerrainPipeline{ VK_NULL_HANDLE };  //terrain.vert - for HeightMap::makeDisplacedTerrain()
+    VkPipeline mTerrainMeshPipeline{ VK_NULL_HANDLE };  //terrainmesh.vert - for the TerrainVertex of HeightMap::makeTerrain()
+    VkPipeline mTerrainMeshStripPipeline{ VK_NULL_HANDLE };    //the same with triangle strips and primitive restart
 
     VkQueue mGraphicsQueue{ VK_NULL_HANDLE };
 
@@ -90,12 +118,54 @@ private:
 	std::vector<VisualObject*> mObjects;    //All objects in the program  
     std::unordered_map<std::string, VisualObject*> mMap;    // alternativ container
 
+    //Objects made by importObjectAsync(), waiting for their buffers
+    std::vector<VisualObject*> mPendingObjects;
+    std::mutex mPendingObjectsMutex;
+    std::vector<std::thread> mImportThreads;
+    std::vector<std::thread::id> mFinishedImportThreads;  //guarded by mPendingObjectsMutex, joined in addPendingObjects()
+    void addPendingObjects();   //called at the start of each frame
+
+    //Import of obj files too big to read into memory: the worker thread writes the mesh straight into a few
+    //mapped staging buffers, and the filled ones are copied to the GPU at the start of each frame. Defined in Renderer.cpp
+    struct StreamedImport;
+    std::vector<std::unique_ptr<StreamedImport>> mStreamedImports;
+    //sceneObject is a streamed mesh already in mObjects, to stream again after its buffers were released
+    void startStreamedImport(const std::string& filename, VisualObject* sceneObject = nullptr);
+    void uploadStreamedImports();   //called from addPendingObjects()
+    void cancelStreamedImports();
+    void removeObject(VisualObject* object);
+
+    //Terrain streamed in tiles around the camera, if one is opened
+    std::unique_ptr<PagedTerrain> mPagedTerrain;
+    void updatePagedTerrain();      //called at the start of each frame
+    void drawPagedTerrain(VkCommandBuffer commandBuffer);
+    void releasePagedTerrainBuffers(HeightMap* tile);
+
+    //Positions, rotations, scales, world matrices and radii of all the objects in mObjects, for the per-frame systems
+    TransformStore mTransforms;
+    std::vector<uint8_t> mVisibleEntities;      //from TransformStore::cull(), each frame
+    std::vector<uint32_t> mOverlappingEntities; //for onCollision()
+    std::vector<uint32_t> mLastOverlappingEntities; //from the frame before, so onCollision() only logs changes
+
+    //Puts every object with followsTerrain() on the ground, with one getHeightsAt() for all of them - of the paged terrain
+    //first if one is open, then of the static terrain for the rest. Called each frame
+    void clampToGround();
+    //Kept between the frames, so they are not allocated each time
+    std::vector<uint32_t> mGroundFollowers;     //entities in mTransforms
+    std::vector<QVector2D> mGroundPositions;
+    std::vector<float> mGroundHeights;
+    std::vector<uint8_t> mGroundResident;      //from PagedTerrain::getHeightsAt()
+
+    uint64_t mDrawRecordingAllocations{ 0 };
+
     void createBuffer(VkDevice logicalDevice,
                       const VkDeviceSize uniAlign, VisualObject* visualObject,
                       VkBufferUsageFlags usage=VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
 
 	//Start of Uniforms and DescriptorSets
 	void createVertexBuffer(const VkDeviceSize uniformAlignment, VisualObject* visualObject);
+    //For vertices that are not Vertex, ie. the TerrainVertex of a HeightMap
+    void createVertexBuffer(const VkDeviceSize uniformAlignment, VisualObject* visualObject, const void* vertexData, VkDeviceSize vertexSize);
 	void createIndexBuffer(const VkDeviceSize uniformAlignment, VisualObject* visualObject);
     void createUniformBuffer();
     void createDescriptorSetLayouts();
@@ -105,6 +175,9 @@ private:
 
 	void createTextureSampler();
     TextureHandle createTexture(const char* filename);
+    //The height samples of a displaced terrain, as an R8 or R16 texture the vertex shader can read
+    TextureHandle createHeightTexture(const HeightMap* heightMap);
+    void createTextureDescriptorSet(TextureHandle& textureHandle);
 	TextureHandle createImage(int width, int height, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkFormat format);
 	void transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout);
 	void copyBufferToImage(VkBuffer buffer, VkImage image, int width, int height);
@@ -118,6 +191,13 @@ private:
 
     TextureHandle mDefaultTextureHandle{};
 
+    //The flat grid all chunks of the displaced terrains are drawn with: (kChunkQuads + 1)^2 vertices of 2 floats
+    BufferHandle mTerrainPatchVertexBuffer{};
+    BufferHandle mTerrainPatchIndexBuffer{};
+    uint32_t mTerrainPatchIndexCount{ 0 };
+    std::vector<TerrainLodSelection> mTerrainLodSelection;    //kept between the frames, so it is not allocated each time
+    void createTerrainPatch();
+
 	uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags requiredProperties);
 
 	BufferHandle createGeneralBuffer(const VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties);
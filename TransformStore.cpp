@@ -0,0 +1,137 @@
+#include "TransformStore.h"
+#include "VisualObject.h"
+#include "Frustum.h"
+#include <cmath>
+
+TransformStore::~TransformStore()
+{
+    while (!mOwners.empty())
+        remove(mOwners.back());
+}
+
+void TransformStore::add(VisualObject* object)
+{
+    if (object->mTransformStore)
+        object->mTransformStore->remove(object);
+
+    const Transform& transform = object->mTransform;
+    mPositions.push_back(transform.position);
+    mRotations.push_back(transform.rotation);
+    mScales.push_back(transform.scale);
+    mWorldMatrices.push_back(makeWorldMatrix(transform.position, transform.rotation, transform.scale));
+    mChanged.push_back(0);
+    mRadii.push_back(transform.radius);
+    mFlags.push_back(transform.flags);
+    mBoundingCenters.push_back(object->getBoundingCenter());
+    mBoundingRadii.push_back(object->getBoundingRadius());
+    mOwners.push_back(object);
+
+    object->mTransformStore = this;
+    object->mEntity = static_cast<uint32_t>(mOwners.size() - 1);
+}
+
+void TransformStore::remove(VisualObject* object)
+{
+    if (object->mTransformStore != this)
+        return;
+    const uint32_t entity = object->mEntity;
+    object->mTransform = get(entity);
+    object->mTransformStore = nullptr;
+
+    //The last entity takes the place of the removed one
+    const uint32_t last = static_cast<uint32_t>(mOwners.size() - 1);
+    if (entity != last)
+    {
+        mPositions[entity] = mPositions[last];
+        mRotations[entity] = mRotations[last];
+        mScales[entity] = mScales[last];
+        mWorldMatrices[entity] = mWorldMatrices[last];
+        mChanged[entity] = mChanged[last];
+        mRadii[entity] = mRadii[last];
+        mFlags[entity] = mFlags[last];
+        mBoundingCenters[entity] = mBoundingCenters[last];
+        mBoundingRadii[entity] = mBoundingRadii[last];
+        mOwners[entity] = mOwners[last];
+        mOwners[entity]->mEntity = entity;
+    }
+    mPositions.pop_back();
+    mRotations.pop_back();
+    mScales.pop_back();
+    mWorldMatrices.pop_back();
+    mChanged.pop_back();
+    mRadii.pop_back();
+    mFlags.pop_back();
+    mBoundingCenters.pop_back();
+    mBoundingRadii.pop_back();
+    mOwners.pop_back();
+}
+
+TransformStore::Transform TransformStore::get(uint32_t entity) const
+{
+    return Transform{ mPositions[entity], mRotations[entity], mScales[entity], mRadii[entity], mFlags[entity] };
+}
+
+void TransformStore::set(uint32_t entity, const Transform& transform)
+{
+    mPositions[entity] = transform.position;
+    mRotations[entity] = transform.rotation;
+    mScales[entity] = transform.scale;
+    mRadii[entity] = transform.radius;
+    mFlags[entity] = transform.flags;
+    mChanged[entity] = 1;
+}
+
+QMatrix4x4 TransformStore::makeWorldMatrix(const QVector3D& position, const QQuaternion& rotation, float scale)
+{
+    QMatrix4x4 matrix;
+    matrix.translate(position);
+    matrix.rotate(rotation);
+    matrix.scale(scale);
+    return matrix;
+}
+
+const QMatrix4x4& TransformStore::getWorldMatrix(uint32_t entity)
+{
+    if (mChanged[entity])
+    {
+        mWorldMatrices[entity] = makeWorldMatrix(mPositions[entity], mRotations[entity], mScales[entity]);
+        mChanged[entity] = 0;
+    }
+    return mWorldMatrices[entity];
+}
+
+void TransformStore::updateWorldMatrices()
+{
+    for (uint32_t entity = 0; entity < mChanged.size(); entity++)
+    {
+        if (!mChanged[entity])
+            continue;
+        mWorldMatrices[entity] = makeWorldMatrix(mPositions[entity], mRotations[entity], mScales[entity]);
+        mChanged[entity] = 0;
+    }
+}
+
+void TransformStore::findOverlaps(uint32_t entity, std::vector<uint32_t>& overlapping) const
+{
+    overlapping.clear();
+    for (uint32_t other = 0; other < mPositions.size(); other++)
+    {
+        if (other != entity && (mFlags[other] & kCollides) && overlaps(entity, other))
+            overlapping.push_back(other);
+    }
+}
+
+void TransformStore::cull(const Frustum& frustum, std::vector<uint8_t>& visible) const
+{
+    visible.resize(mWorldMatrices.size());
+    for (uint32_t entity = 0; entity < mWorldMatrices.size(); entity++)
+    {
+        if (mBoundingRadii[entity] <= 0.f)
+        {
+            visible[entity] = 1;
+            continue;
+        }
+        const QVector3D center = mWorldMatrices[entity].map(mBoundingCenters[entity]);
+        visible[entity] = frustum.intersectsSphere(center, mBoundingRadii[entity] * std::abs(mScales[entity])) ? 1 : 0;
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef TRANSFORMSTORE_H
+#define TRANSFORMSTORE_H
+
+#include <QMatrix4x4>
+#include <QQuaternion>
+#include <QVector3D>
+#include <vector>
+#include <cstdint>
+
+class VisualObject;
+class Frustum;
+
+//The transforms of the objects in the scene as a structure of arrays, indexed by entity id: entity i has its position in
+//getPositions()[i], its radius in getRadii()[i] and so on. The per-frame systems - ground clamping, collision, culling -
+//go through the arrays from start to end, instead of following a VisualObject* to each object.
+//VisualObject::move(), scale(), rotate() and setPosition() write here once the object is added.
+//Removing an entity moves the last one into its place, so the arrays have no holes - the VisualObject always knows its id.
+//Only used from the render thread. Objects made on other threads keep their transform until they are added
+class TransformStore
+{
+public:
+    enum Flags : uint8_t
+    {
+        kFollowsTerrain = 1 << 0,   //kept on the ground by Renderer::clampToGround()
+        kCollides = 1 << 1,         //found by findOverlaps()
+    };
+
+    //The values of one entity, and the transform of a VisualObject that is not in a store
+    struct Transform
+    {
+        QVector3D position{};
+        QQuaternion rotation{};
+        float scale{ 1.f };
+        float radius{ 0.5f };       //for collision
+        uint8_t flags{ kCollides };
+    };
+
+    TransformStore() = default;
+    ~TransformStore();      //the objects still in the store get their transforms back
+    TransformStore(const TransformStore&) = delete;
+    TransformStore& operator=(const TransformStore&) = delete;
+
+    //Moves the transform of the object into the store. Its bounding sphere is copied for cull(), so the mesh must be made
+    void add(VisualObject* object);
+    //Gives the object its transform back
+    void remove(VisualObject* object);
+
+    size_t size() const { return mOwners.size(); }
+    VisualObject* getOwner(uint32_t entity) const { return mOwners[entity]; }
+
+    Transform get(uint32_t entity) const;
+    void set(uint32_t entity, const Transform& transform);
+    //Single values of one entity. The radius and the flags are not in the world matrix, so setting them marks nothing changed
+    float getRadius(uint32_t entity) const { return mRadii[entity]; }
+    void setRadius(uint32_t entity, float radius) { mRadii[entity] = radius; }
+    uint8_t getFlags(uint32_t entity) const { return mFlags[entity]; }
+    void setFlags(uint32_t entity, uint8_t flags) { mFlags[entity] = flags; }
+
+    //translate * rotate * scale - the matrix QMatrix4x4::translate(), rotate() and scale() would have made
+    static QMatrix4x4 makeWorldMatrix(const QVector3D& position, const QQuaternion& rotation, float scale);
+    //The world matrix of the entity, made again first if its transform has changed
+    const QMatrix4x4& getWorldMatrix(uint32_t entity);
+    //Makes the world matrices of all the entities changed since last time. Called once a frame, before drawing
+    void updateWorldMatrices();
+
+    //For the systems. Call markChanged() for the entities whose positions are written
+    std::vector<QVector3D>& getPositions() { return mPositions; }
+    const std::vector<QQuaternion>& getRotations() const { return mRotations; }
+    const std::vector<float>& getScales() const { return mScales; }
+    const std::vector<float>& getRadii() const { return mRadii; }
+    const std::vector<uint8_t>& getFlags() const { return mFlags; }
+    void markChanged(uint32_t entity) { mChanged[entity] = 1; }
+
+    //True if the collision radii of the two entities overlap
+    bool overlaps(uint32_t entity, uint32_t other) const
+    {
+        const float reach = mRadii[entity] + mRadii[other];
+        return (mPositions[entity] - mPositions[other]).lengthSquared() <= reach * reach;
+    }
+    //The entities with kCollides that overlap entity, not counting itself
+    void findOverlaps(uint32_t entity, std::vector<uint32_t>& overlapping) const;
+
+    //visible[i] is 1 if the bounding sphere of entity i can be inside the frustum, else 0. Entities without
+    //a bounding sphere (ie. streamed meshes) are always visible. Uses the world matrices from updateWorldMatrices()
+    void cull(const Frustum& frustum, std::vector<uint8_t>& visible) const;
+
+private:
+    std::vector<QVector3D> mPositions;
+    std::vector<QQuaternion> mRotations;
+    std::vector<float> mScales;
+    std::vector<QMatrix4x4> mWorldMatrices;
+    std::vector<uint8_t> mChanged;              //1 if the world matrix must be made again
+    std::vector<float> mRadii;
+    std::vector<uint8_t> mFlags;
+    std::vector<QVector3D> mBoundingCenters;    //in the coordinate system of the mesh
+    std::vector<float> mBoundingRadii;
+    std::vector<VisualObject*> mOwners;
+};
+
+#endif // TRANSFORMSTORE_H
@@ -9,5 +9,5 @@ Triangle::Triangle() : VisualObject()
     mVertices.push_back(Vertex{ 0.0f,   0.0f,  0.0f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f});
 
 	//Temporary positioning
-    mMatrix.translate(-0.25f, 0, 0);
+    move(-0.25f, 0, 0);
 }
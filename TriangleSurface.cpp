@@ -23,8 +23,8 @@ TriangleSurface::TriangleSurface() : VisualObject()
 	mIndices.push_back(3);
 
     //Temporary scale and positioning
-    mMatrix.scale(0.5f);
-    mMatrix.translate(0.5f, 0.1f, 0.1f);
+    scale(0.5f);
+    move(0.5f, 0.1f, 0.1f);
 }
 
 TriangleSurface::TriangleSurface(const std::string &filename)
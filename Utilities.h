@@ -3,6 +3,9 @@
 
 #include <QVulkanFunctions>
 #include <QMatrix4x4>
+#include <thread>
+#include <algorithm>
+#include <vector>
 #include "Vertex.h"
 
 //Utility function for alignment:
@@ -11,6 +14,30 @@ static inline VkDeviceSize aligned(VkDeviceSize v, VkDeviceSize byteAlign)
     return (v + byteAlign - 1) & ~(byteAlign - 1);
 }
 
+//Runs work(0) ... work(count - 1) on their own threads, work(0) on the calling thread
+template <typename Work>
+void runParallel(size_t count, Work work)
+{
+    std::vector<std::thread> threads;
+    threads.reserve(count > 0 ? count - 1 : 0);
+    for (size_t i = 1; i < count; i++)
+        threads.emplace_back(work, i);
+    if (count > 0)
+        work(0);
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+//Splits [0, count) in bands of at least minPerThread, one band per thread, and calls work(first, last) for each
+template <typename Work>
+void runInBands(size_t count, size_t minPerThread, Work work)
+{
+    const size_t bandCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, std::max<size_t>(count / minPerThread, 1));
+    runParallel(bandCount, [&](size_t band) {
+        work(count * band / bandCount, count * (band + 1) / bandCount);
+    });
+}
+
 //Utility struct for handling buffers
 struct BufferHandle
 {
@@ -18,6 +45,32 @@ struct BufferHandle
     VkBuffer mBuffer{ VK_NULL_HANDLE };
 };
 
+//One level of detail of a mesh: a range in the index buffer, and how far (in mesh units) it is from the full mesh
+struct LodLevel
+{
+    uint32_t firstIndex{ 0 };
+    uint32_t indexCount{ 0 };
+    float error{ 0.f };
+};
+
+//A small cluster of triangles (a range in the index buffer), with bounds for culling it on the CPU
+struct Meshlet
+{
+    uint32_t firstIndex{ 0 };
+    uint32_t indexCount{ 0 };
+    QVector3D center{};         //bounding sphere, in the coordinate system of the mesh
+    float radius{ 0.f };
+    QVector3D coneAxis{};       //average direction of the triangle normals
+    float coneCutoff{ 1.f };    //1 = the normals spread too much, never backface culled
+
+    //True if the camera sees the back side of every triangle in the meshlet. Only for pipelines that cull back faces
+    bool isBackfacing(const QVector3D& cameraPosition) const
+    {
+        QVector3D toCenter = center - cameraPosition;
+        return QVector3D::dotProduct(toCenter, coneAxis) >= coneCutoff * toCenter.length() + radius;
+    }
+};
+
 struct TextureHandle
 {
 	VkDeviceMemory mTextureMemory{ VK_NULL_HANDLE };
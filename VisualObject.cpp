@@ -1,32 +1,191 @@
 #include "VisualObject.h"
+#include <algorithm>
+#include "MeshOptimizer.h"
+
+//Share of the triangles kept in each level of detail
+static constexpr float kLodTriangleShare[]{ 0.5f, 0.25f, 0.1f };
+//Largest simplification error allowed on screen, in pixels
+static constexpr float kLodMaxErrorPixels{ 1.0f };
+//Meshes with fewer triangles than this are drawn whole - culling them in parts costs more than it saves
+static constexpr size_t kMinMeshletTriangles{ 4096 };
 
 VisualObject::VisualObject()
 {
-    mMatrix.setToIdentity();
+}
+
+VisualObject::~VisualObject()
+{
+    if (mTransformStore)
+        mTransformStore->remove(this);
 }
 
 void VisualObject::move(float x, float y, float z)
 {
-    mMatrix.translate(x, y, z);
+    TransformStore::Transform transform = getTransform();
+    transform.position += transform.rotation.rotatedVector(QVector3D(x, y, z)) * transform.scale;
+    setTransform(transform);
 }
 
 void VisualObject::scale(float s)
 {
-    mMatrix.scale(s);
+    TransformStore::Transform transform = getTransform();
+    transform.scale *= s;
+    setTransform(transform);
 }
 
 void VisualObject::rotate(float t, float x, float y, float z)
 {
-    mMatrix.rotate(t, x, y, z);
+    TransformStore::Transform transform = getTransform();
+    transform.rotation = (transform.rotation * QQuaternion::fromAxisAndAngle(x, y, z, t)).normalized();
+    setTransform(transform);
 }
 
 void VisualObject::setPosition(const QVector3D& pos) {
-    mMatrix.setColumn(3, QVector4D(pos, 1.0f));
+    TransformStore::Transform transform = getTransform();
+    transform.position = pos;
+    setTransform(transform);
+}
+
+QVector3D VisualObject::getPosition() const
+{
+    return mTransformStore ? mTransformStore->getPositions()[mEntity] : mTransform.position;
 }
 
-QVector3D VisualObject::getPosition()
+QMatrix4x4 VisualObject::getMatrix() const
 {
-    return QVector3D(mMatrix(0,3), mMatrix(1,3), mMatrix(2,3));
+    if (mTransformStore)
+        return mTransformStore->getWorldMatrix(mEntity);
+    return TransformStore::makeWorldMatrix(mTransform.position, mTransform.rotation, mTransform.scale);
 }
 
+TransformStore::Transform VisualObject::getTransform() const
+{
+    return mTransformStore ? mTransformStore->get(mEntity) : mTransform;
+}
+
+void VisualObject::setTransform(const TransformStore::Transform& transform)
+{
+    if (mTransformStore)
+        mTransformStore->set(mEntity, transform);
+    else
+        mTransform = transform;
+}
+
+float VisualObject::getRadius() const
+{
+    return mTransformStore ? mTransformStore->getRadius(mEntity) : mTransform.radius;
+}
+
+void VisualObject::setRadius(float radius)
+{
+    if (mTransformStore)
+        mTransformStore->setRadius(mEntity, radius);
+    else
+        mTransform.radius = radius;
+}
+
+uint8_t VisualObject::getFlags() const
+{
+    return mTransformStore ? mTransformStore->getFlags(mEntity) : mTransform.flags;
+}
+
+void VisualObject::setFlags(uint8_t flags)
+{
+    if (mTransformStore)
+        mTransformStore->setFlags(mEntity, flags);
+    else
+        mTransform.flags = flags;
+}
+
+void VisualObject::setCollisionEnabled(bool enabled)
+{
+    const uint8_t flags = getFlags();
+    setFlags(enabled ? (flags | TransformStore::kCollides) : (flags & ~TransformStore::kCollides));
+}
 
+void VisualObject::setFollowsTerrain(bool follows)
+{
+    const uint8_t flags = getFlags();
+    setFlags(follows ? (flags | TransformStore::kFollowsTerrain) : (flags & ~TransformStore::kFollowsTerrain));
+}
+
+void VisualObject::optimizeMesh()
+{
+    if (mMeshOptimized || mIndices.size() < 3)
+        return;
+
+    auto before = MeshOptimizer::analyzeVertexCache(mIndices.data(), mIndices.size(), mVertices.size());
+    MeshOptimizer::optimizeVertexCache(mIndices.data(), mIndices.size(), mVertices.size());
+    MeshOptimizer::optimizeVertexFetch(mVertices, mIndices);
+    auto after = MeshOptimizer::analyzeVertexCache(mIndices.data(), mIndices.size(), mVertices.size());
+    mMeshOptimized = true;
+
+    qDebug() << mName.c_str() << "vertex cache optimized - ACMR" << before.acmr << "->" << after.acmr
+             << " ATVR" << before.atvr << "->" << after.atvr;
+}
+
+void VisualObject::generateLods()
+{
+    //Only filled triangle meshes, and only once
+    if (!mLodLevels.empty() || drawType != 0 || mIndices.size() < 3)
+        return;
+
+    calculateBoundingSphere();
+    mLodLevels.push_back(LodLevel{ 0, static_cast<uint32_t>(mIndices.size()), 0.f });
+
+    for (float share : kLodTriangleShare)
+    {
+        size_t targetIndexCount = static_cast<size_t>(mIndices.size() / 3 * share) * 3;
+        float error{ 0.f };
+        std::vector<uint32_t> lod = MeshOptimizer::simplify(mVertices, mIndices, targetIndexCount, &error);
+        if (lod.size() >= mLodLevels.back().indexCount)
+            break;  //could not simplify more
+
+        MeshOptimizer::optimizeVertexCache(lod.data(), lod.size(), mVertices.size());
+        mLodLevels.push_back(LodLevel{ static_cast<uint32_t>(mIndices.size() + mLodIndices.size()),
+                                       static_cast<uint32_t>(lod.size()), error });
+        mLodIndices.insert(mLodIndices.end(), lod.begin(), lod.end());
+    }
+
+    for (size_t i = 1; i < mLodLevels.size(); i++)
+        qDebug() << mName.c_str() << "LOD" << i << ":" << mLodLevels[i].indexCount / 3 << "triangles, error" << mLodLevels[i].error;
+}
+
+LodLevel VisualObject::selectLod(float pixelsPerUnit) const
+{
+    for (size_t i = mLodLevels.size(); i-- > 1;)
+    {
+        if (mLodLevels[i].error * pixelsPerUnit <= kLodMaxErrorPixels)
+            return mLodLevels[i];
+    }
+    return LodLevel{ 0, static_cast<uint32_t>(getIndexCount()), 0.f };
+}
+
+void VisualObject::buildMeshlets()
+{
+    if (!mMeshlets.empty() || drawType != 0 || mIndices.size() / 3 < kMinMeshletTriangles)
+        return;
+
+    mMeshlets = MeshOptimizer::buildMeshlets(mVertices, mIndices.data(), mIndices.size());
+    qDebug() << mName.c_str() << "split into" << mMeshlets.size() << "meshlets";
+}
+
+//Sphere around the bounding box of the mesh, in its own coordinate system
+void VisualObject::calculateBoundingSphere()
+{
+    if (mVertices.empty())
+        return;
+
+    QVector3D minimum(mVertices[0].x, mVertices[0].y, mVertices[0].z);
+    QVector3D maximum = minimum;
+    for (const Vertex& vertex : mVertices)
+    {
+        minimum = QVector3D(std::min(minimum.x(), vertex.x), std::min(minimum.y(), vertex.y), std::min(minimum.z(), vertex.z));
+        maximum = QVector3D(std::max(maximum.x(), vertex.x), std::max(maximum.y(), vertex.y), std::max(maximum.z(), vertex.z));
+    }
+    mBoundingCenter = (minimum + maximum) * 0.5f;
+
+    mBoundingRadius = 0.f;
+    for (const Vertex& vertex : mVertices)
+        mBoundingRadius = std::max(mBoundingRadius, (QVector3D(vertex.x, vertex.y, vertex.z) - mBoundingCenter).length());
+}
@@ -4,19 +4,53 @@
 #include <QVulkanWindow>
 #include <vector>
 #include "Utilities.h"
+#include "TransformStore.h"
 
 
 class VisualObject
 {
 public:
     VisualObject();
+    virtual ~VisualObject();     //leaves its TransformStore
 
+    //In the coordinate system of the object, as QMatrix4x4::translate(), scale() and rotate().
+    //The transform is in the TransformStore the object is added to, else in the object
     void move(float x, float y = 0.0f, float z = 0.0f);
     void scale(float s);
     void rotate(float t, float x, float y, float z);
 
+    //Reorders triangles and vertices for the GPU vertex caches, see MeshOptimizer.h
+    //Must be called before the buffers are made. Logs ACMR/ATVR before and after
+    virtual void optimizeMesh();
+
+    //Makes simplified versions of the mesh (level of detail) with 50%, 25% and 10% of the triangles
+    //Must be called before the buffers are made
+    virtual void generateLods();
+    //The coarsest level that looks the same as the full mesh (error less than a pixel),
+    //when one unit of the mesh covers pixelsPerUnit pixels on screen
+    LodLevel selectLod(float pixelsPerUnit) const;
+    inline const std::vector<uint32_t>& getLodIndices() const { return mLodIndices; }
+    //Splits big meshes into meshlets that can be culled one by one. Small meshes get none
+    //Must be called after optimizeMesh()
+    virtual void buildMeshlets();
+    inline const std::vector<Meshlet>& getMeshlets() const { return mMeshlets; }
+
+    inline QVector3D getBoundingCenter() const { return mBoundingCenter; }
+    inline float getBoundingRadius() const { return mBoundingRadius; }
+
+    //Number of vertices and indices in the buffers, without touching the mesh data - for the draw calls.
+    //A streamed mesh (see ObjectMesh::streamObjFile()) only has its data on the GPU, not in mVertices/mIndices
+    inline size_t getVertexCount() const { return mVertices.empty() ? mStreamedVertexCount : mVertices.size(); }
+    inline size_t getIndexCount() const { return mIndices.empty() ? mStreamedIndexCount : mIndices.size(); }
+    inline void setStreamedCounts(size_t vertexCount, size_t indexCount) { mStreamedVertexCount = vertexCount; mStreamedIndexCount = indexCount; }
+    //The obj file a streamed mesh is read from, so it can be streamed again after its buffers are lost
+    inline const std::string& getStreamedFile() const { return mStreamedFile; }
+    inline void setStreamedFile(const std::string& filename) { mStreamedFile = filename; }
+
 	//Setters and Getters
-    inline std::vector<Vertex> getVertices() { return mVertices; }
+    //The mesh data is returned by reference, not copied
+    inline const std::vector<Vertex>& getVertices() const { return mVertices; }
+    inline const std::vector<uint32_t>& getIndices() const { return mIndices; }
     inline VkBuffer& getVBuffer() { return mVertexBuffer.mBuffer; }
     inline VkDeviceMemory& getVBufferMemory() { return mVertexBuffer.mBufferMemory; }
 	inline VkDeviceMemory& getIBufferMemory() { return mIndexBuffer.mBufferMemory; }
@@ -26,29 +60,37 @@ public:
     inline void setIBuffer(VkBuffer bufferIn) { mIndexBuffer.mBuffer = bufferIn; }
     inline void setIBufferMemory(VkDeviceMemory bufferMemoryIn) { mIndexBuffer.mBufferMemory = bufferMemoryIn; }
     inline void setName(std::string name) { mName = name; }
-    inline std::string getName() const { return mName; }
+    inline const std::string& getName() const { return mName; }
     inline int getDrawType() const { return drawType; }
-    inline QMatrix4x4 getMatrix() const {return mMatrix;}
-	inline std::vector<Vertex> getVertices() const { return mVertices; }
-	inline std::vector<uint32_t> getIndices() const { return mIndices; }
+    QMatrix4x4 getMatrix() const;
 
     TextureHandle mTexturehandle;
-    //for collision
-    float radius{0.5f};
 
     void setPosition(const QVector3D& pos);
-    QVector3D getPosition();
-    std::string getTag() const{return mTag;}
+    QVector3D getPosition() const;
+    const std::string& getTag() const{return mTag;}
     void setTag(std::string tag);
 
-    bool enableCollision{true}; //Won't trigger collision logic if false
+    TransformStore::Transform getTransform() const;
+    void setTransform(const TransformStore::Transform& transform);
+    //Id in the TransformStore, if the object is added to one
+    inline TransformStore* getTransformStore() const { return mTransformStore; }
+    inline uint32_t getEntity() const { return mEntity; }
+
+    //for collision
+    float getRadius() const;
+    void setRadius(float radius);
+    bool isCollisionEnabled() const { return getFlags() & TransformStore::kCollides; }
+    void setCollisionEnabled(bool enabled);     //Won't trigger collision logic if false
+    //Kept on the terrain each frame by Renderer::clampToGround(), with the center radius above the ground
+    bool followsTerrain() const { return getFlags() & TransformStore::kFollowsTerrain; }
+    void setFollowsTerrain(bool follows);
 
     //for the door,would be nice on the wall class, to be continued
     bool isOpen{false};
 protected:
     std::vector<Vertex> mVertices;
     std::vector<uint32_t> mIndices;
-    QMatrix4x4 mMatrix;
     std::string mName;
     std::string mTag{"actor"};
 	BufferHandle mVertexBuffer;
@@ -56,6 +98,29 @@ protected:
     //VkPrimitiveTopology mTopology{ VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST }; //not used
 
     int drawType{ 0 }; // 0 = fill, 1 = line
+    bool mMeshOptimized{ false };   //optimizeMesh() has nothing to do if the mesh is already optimized
+
+    //Level of detail: level 0 is all of mIndices. The simplified levels are stored after each other in mLodIndices,
+    //and uploaded right after mIndices in the index buffer, so firstIndex counts from the start of mIndices
+    std::vector<uint32_t> mLodIndices;
+    std::vector<LodLevel> mLodLevels;
+    std::vector<Meshlet> mMeshlets;     //covers all of mIndices (level of detail 0)
+    void calculateBoundingSphere();
+    QVector3D mBoundingCenter{};
+    float mBoundingRadius{ 0.f };
+
+    size_t mStreamedVertexCount{ 0 };
+    size_t mStreamedIndexCount{ 0 };
+    std::string mStreamedFile;
+
+private:
+    friend class TransformStore;
+    TransformStore* mTransformStore{ nullptr };
+    uint32_t mEntity{ 0 };
+    TransformStore::Transform mTransform{};     //only used while the object is not in a TransformStore
+    //The TransformStore::Flags of the object, from the store if it is in one
+    uint8_t getFlags() const;
+    void setFlags(uint8_t flags);
 };
 
 #endif // VISUALOBJECT_H
@@ -10,7 +10,5 @@ WorldAxis::WorldAxis()
     mVertices.push_back(Vertex{ 0.f, 100.f, 0.f,     0.f, 1.f, 0.f,    0.f, 0.f });
 	mVertices.push_back(Vertex{ 0.f, 0.f, -100.f,       0.f, 0.f, 1.f,    0.f, 0.f }); //z-axis
     mVertices.push_back(Vertex{ 0.f, 0.f, 100.f,     0.f, 0.f, 1.f,    0.f, 0.f });
-
-    mMatrix.setToIdentity();
 }
 
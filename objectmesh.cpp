@@ -1,9 +1,35 @@
 #include "ObjectMesh.h"
+#include "MeshCodec.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
 
 
 ObjectMesh::ObjectMesh(const std::string& filename)
 {
-    if (!readObjFile(filename))  //If file not read, just make a triangle
+    mName = filename;   //default name, usually replaced with setName()
+
+    if (readCacheFile(filename))  //Parsed before and the obj file is unchanged - no parsing needed
+    {
+        mMeshOptimized = true;    //the cache is written after optimizeMesh() and generateLods()
+        calculateBoundingSphere();
+    }
+    else if (readObjFile(filename))
+    {
+        calculateBounds();
+        optimizeMesh();
+        generateLods();
+        if (!writeCacheFile(filename))
+            qDebug() << "Could not write mesh cache for" << filename.c_str();
+    }
+    else  //If file not read, just make a triangle
     {
         mVertices.push_back(Vertex{ -0.5f,   0.0f,  0.0f,   1.0f, 0.0f, 0.0f, 0.0f, 0.0f });
         mVertices.push_back(Vertex{ -0.5f,   -0.5f,  0.0f,   0.0f, 1.0f, 0.0f, 0.0f, 0.0f });
@@ -11,154 +37,732 @@ ObjectMesh::ObjectMesh(const std::string& filename)
         qDebug("Made you a triangle instead...");
     }
 
-    mMatrix.translate(1.f, 0, 0);
+    move(1.f, 0, 0);
 }
 
-bool ObjectMesh::readObjFile(const std::string& filename)
+// Small helpers for scanning the memory mapped obj file in place.
+// They all work on a [cursor, end) range and never allocate.
+namespace
 {
-    std::string tempName{};
+inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
 
-    tempName = "../../Meshes/" + filename;
-    qDebug() << "Reading " << tempName.c_str();
-    std::ifstream fileIn;
-    fileIn.open(tempName, std::ifstream::in);
-    if (!fileIn)
-    {
-        qDebug() << "ERROR: Could not open file for reading: " << filename.c_str();
+inline void skipBlanks(const char*& cursor, const char* end)
+{
+    while (cursor < end && isBlank(*cursor))
+        ++cursor;
+}
+
+//Moves the cursor to the first character of the next line
+inline void skipLine(const char*& cursor, const char* end)
+{
+    while (cursor < end && *cursor != '\n')
+        ++cursor;
+    if (cursor < end)
+        ++cursor;
+}
+
+//Reads one float - std::from_chars does not accept a leading '+', std::stof did
+inline bool readFloat(const char*& cursor, const char* end, float& value)
+{
+    skipBlanks(cursor, end);
+    if (cursor < end && *cursor == '+')
+        ++cursor;
+    auto [ptr, error] = std::from_chars(cursor, end, value);
+    if (error != std::errc())
         return false;
-    }
-    //One line at a time-variable
-    std::string oneLine{};
-    //One word at a time-variable
-    std::string oneWord{};
+    cursor = ptr;
+    return true;
+}
 
-    // temp variables to store the data from the file
-    std::vector<QVector3D> tempVertecies;
-    std::vector<QVector3D> tempNormals;
-    std::vector<QVector2D> tempUVs;
-
-    // Varible for constructing the indices vector
-    // All obj files use indices
-    unsigned int temp_index = 0;
-
-    //Reading one line at a time from file to oneLine
-    while (std::getline(fileIn, oneLine))
-    {
-        //Doing a trick to get one word at a time
-        std::stringstream sStream;
-        //Pushing line into stream
-        sStream << oneLine;
-        //Streaming one word out of line
-        oneWord = ""; //resetting the value or else the last value might survive!
-        sStream >> oneWord;
-
-        if (oneWord == "#")
+//Reads one integer inside a face corner, ie. the "12" in "12/3/4"
+inline bool readInt(const char*& cursor, const char* end, int& value)
+{
+    auto [ptr, error] = std::from_chars(cursor, end, value);
+    if (error != std::errc())
+        return false;
+    cursor = ptr;
+    return true;
+}
+
+//Reads one face corner "v/vt/vn", "v//vn" or "v". Missing parts are returned as 0
+inline bool readCorner(const char*& cursor, const char* end, int& index, int& uv, int& normal)
+{
+    skipBlanks(cursor, end);
+    index = uv = normal = 0;
+    if (!readInt(cursor, end, index))
+        return false;
+    if (cursor < end && *cursor == '/')
+    {
+        ++cursor;
+        if (cursor < end && *cursor != '/')
+            readInt(cursor, end, uv);
+        if (cursor < end && *cursor == '/')
         {
-            //Ignore this line
-            //qDebug() << "Line is comment "  << QString::fromStdString(oneWord);
-            continue;
+            ++cursor;
+            readInt(cursor, end, normal);
         }
-        if (oneWord == "")
+    }
+    return true;
+}
+
+//One face corner as the three (0-based) indices from the f-line. Used as key when welding vertices
+struct CornerKey
+{
+    int index;
+    int uv;
+    int normal;
+
+    bool operator==(const CornerKey& other) const
+    {
+        return index == other.index && uv == other.uv && normal == other.normal;
+    }
+};
+
+struct CornerKeyHash
+{
+    size_t operator()(const CornerKey& key) const
+    {
+        //Mixing the three indices with large odd constants - cheap and spreads well for sequential indices
+        uint64_t h = static_cast<uint32_t>(key.index) * 0x9E3779B97F4A7C15ull;
+        h ^= static_cast<uint32_t>(key.uv) * 0xC2B2AE3D27D4EB4Full + (h >> 29);
+        h ^= static_cast<uint32_t>(key.normal) * 0x165667B19E3779F9ull + (h >> 32);
+        return static_cast<size_t>(h);
+    }
+};
+
+//Layout of the start of a .meshcache file. After it follows encodedSize bytes of MeshCodec data
+//(the vertices, and the indices followed by the level of detail indices), and then the LodLevel array.
+//The data is written in the byte order of the machine.
+struct MeshCacheHeader
+{
+    char magic[4];              //"OMSH"
+    uint32_t version;           //bump kMeshCacheVersion when the layout of this header or Vertex changes
+    uint32_t vertexSize;        //sizeof(Vertex) when written
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t lodLevelCount;
+    int64_t sourceSize;         //size of the obj file the cache was made from
+    int64_t sourceModified;     //modification time of the obj file, ms since epoch
+    float boundsMin[3];
+    float boundsMax[3];
+    uint32_t lodIndexCount;
+    uint32_t encodedSize;
+};
+
+constexpr uint32_t kMeshCacheVersion{ 5 };      //2: vertex cache optimized mesh, 3: levels of detail, 4: MeshCodec compressed, 5: zero normals kept
+
+//Files smaller than this are not worth starting threads for
+constexpr qint64 kParallelParseBytes{ 4 * 1024 * 1024 };
+constexpr qint64 kMinChunkBytes{ 1024 * 1024 };
+
+//Meshes are read from the Meshes folder, unless the filename is a full path (ie. from the file dialog)
+std::string meshPath(const std::string& filename)
+{
+    return QFileInfo(QString::fromStdString(filename)).isAbsolute() ? filename : "../../Meshes/" + filename;
+}
+std::string cachePath(const std::string& filename) { return meshPath(filename) + ".meshcache"; }
+
+//Finds the n-th v, vt or vn line of a memory mapped obj file, without holding all of them in memory.
+//Only the file offset of every kBlockRecords-th line is stored. The lines are read again from the file a block at a time,
+//and the last used blocks are kept in a small cache - the faces of a mesh mostly use vertices close to each other in the file
+template <int Components>
+class ObjRecordTable
+{
+public:
+    ObjRecordTable(const char* keyword, const char* begin, const char* end)
+        : mKeyword(keyword), mKeywordLength(strlen(keyword)), mBegin(begin), mEnd(end), mCache(kCacheBlocks) {}
+
+    void addRecord(const char* line)
+    {
+        if (mCount % kBlockRecords == 0)
+            mBlockOffsets.push_back(static_cast<uint64_t>(line - mBegin));
+        ++mCount;
+    }
+    size_t size() const { return mCount; }
+
+    //The Components floats of record number index, or nullptr if the line is malformed
+    const float* get(size_t index)
+    {
+        const size_t block = index / kBlockRecords;
+        CachedBlock& cached = mCache[block % kCacheBlocks];
+        if (cached.block != block && !readBlock(block, cached))
+            return nullptr;
+        return cached.values + (index % kBlockRecords) * Components;
+    }
+
+private:
+    static constexpr size_t kBlockRecords{ 32 };
+    static constexpr size_t kCacheBlocks{ 1024 };   //32k lines - 384 kB for positions
+
+    struct CachedBlock
+    {
+        size_t block{ SIZE_MAX };
+        float values[kBlockRecords * Components];
+    };
+
+    bool readBlock(size_t block, CachedBlock& cached)
+    {
+        cached.block = SIZE_MAX;
+        const size_t count = std::min(kBlockRecords, mCount - block * kBlockRecords);
+        const char* cursor = mBegin + mBlockOffsets[block];
+        size_t record{ 0 };
+        while (record < count && cursor < mEnd)
         {
-            //Ignore this line
-            //qDebug() << "Line is blank ";
-            continue;
+            skipBlanks(cursor, mEnd);
+            const char* word = cursor;
+            while (cursor < mEnd && !isBlank(*cursor) && *cursor != '\n')
+                ++cursor;
+            if (static_cast<size_t>(cursor - word) == mKeywordLength && memcmp(word, mKeyword, mKeywordLength) == 0)
+            {
+                float* values = cached.values + record * Components;
+                for (int i = 0; i < Components; i++)
+                {
+                    if (!readFloat(cursor, mEnd, values[i]))
+                        return false;
+                }
+                ++record;
+            }
+            skipLine(cursor, mEnd);
         }
-        if (oneWord == "v")
+        if (record < count)
+            return false;
+        cached.block = block;
+        return true;
+    }
+
+    const char* mKeyword;
+    size_t mKeywordLength;
+    const char* mBegin;
+    const char* mEnd;
+    size_t mCount{ 0 };
+    std::vector<uint64_t> mBlockOffsets;
+    std::vector<CachedBlock> mCache;
+};
+}
+
+struct ObjectMesh::ObjChunk
+{
+    std::vector<QVector3D> positions;
+    std::vector<QVector3D> normals;
+    std::vector<QVector2D> uvs;
+    std::vector<CornerKey> uniqueCorners;   //each corner the first time it is seen in this chunk, in file order
+    std::vector<uint32_t> cornerIndices;    //for each face corner: its number in uniqueCorners
+    bool ok{ true };
+};
+
+//Scans the lines in [cursor, end) into chunk.
+//Face corners are kept as the raw (0-based) index triples, welded within the chunk only.
+//The indices can point to v/vt/vn lines in other chunks, so they are checked when the chunks are merged
+void ObjectMesh::parseObjChunk(const char* cursor, const char* end, ObjChunk& chunk)
+{
+    std::unordered_map<CornerKey, uint32_t, CornerKeyHash> weldedCorners;
+
+    //Reading one line at a time
+    while (cursor < end && chunk.ok)
+    {
+        skipBlanks(cursor, end);
+        if (cursor >= end)
+            break;
+
+        //Finding the first word of the line, without copying it
+        const char* word = cursor;
+        while (cursor < end && !isBlank(*cursor) && *cursor != '\n')
+            ++cursor;
+        const size_t wordLength = cursor - word;
+
+        if (wordLength == 1 && word[0] == 'v')
         {
-            //qDebug() << "Line is vertex "  << QString::fromStdString(oneWord) << " ";
-            QVector3D tempVertex;
-            sStream >> oneWord;
-            tempVertex.setX(std::stof(oneWord));
-            sStream >> oneWord;
-            tempVertex.setY(std::stof(oneWord));
-            sStream >> oneWord;
-            tempVertex.setZ(std::stof(oneWord));
-
-            //Vertex made - pushing it into vertex-vector
-            tempVertecies.push_back(tempVertex);
-
-            continue;   //jump out of the while loop
+            float x{}, y{}, z{};
+            chunk.ok = readFloat(cursor, end, x) && readFloat(cursor, end, y) && readFloat(cursor, end, z);
+            chunk.positions.emplace_back(x, y, z);
         }
-        if (oneWord == "vt")
+        else if (wordLength == 2 && word[0] == 'v' && word[1] == 't')
         {
-            //qDebug() << "Line is UV-coordinate "  << QString::fromStdString(oneWord) << " ";
-            QVector2D tempUV;
-            sStream >> oneWord;
-            tempUV.setX(std::stof(oneWord));
-            sStream >> oneWord;
-            tempUV.setY(std::stof(oneWord));
-
-            //UV made - pushing it into UV-vector
-            tempUVs.push_back(tempUV);
-
-            continue;
+            float u{}, v{};
+            chunk.ok = readFloat(cursor, end, u) && readFloat(cursor, end, v);
+            chunk.uvs.emplace_back(u, v);
         }
-        if (oneWord == "vn")
+        else if (wordLength == 2 && word[0] == 'v' && word[1] == 'n')
         {
-            //qDebug() << "Line is normal "  << QString::fromStdString(oneWord) << " ";
-            QVector3D tempNormal;
-            sStream >> oneWord;
-            tempNormal.setX(std::stof(oneWord));
-            sStream >> oneWord;
-            tempNormal.setY(std::stof(oneWord));
-            sStream >> oneWord;
-            tempNormal.setZ(std::stof(oneWord));
-
-            //Vertex made - pushing it into vertex-vector
-            tempNormals.push_back(tempNormal);
-            continue;
+            float x{}, y{}, z{};
+            chunk.ok = readFloat(cursor, end, x) && readFloat(cursor, end, y) && readFloat(cursor, end, z);
+            chunk.normals.emplace_back(x, y, z);
         }
-        if (oneWord == "f")
+        else if (wordLength == 1 && word[0] == 'f')
         {
-            //qDebug() << "Line is a face "  << QString::fromStdString(oneWord) << " ";
             int index, normal, uv;
             for (int i = 0; i < 3; i++)
             {
-                sStream >> oneWord;                             //one word read
-                std::stringstream tempWord(oneWord);            //to use getline on this one word
-                std::string segment;                            //the numbers in the f-line
-                std::vector<std::string> segmentArray;          //temp array of the numbers
-                while (std::getline(tempWord, segment, '/'))    //splitting word in segments at /
-                {
-                    segmentArray.push_back(segment);
-                }
-                index = std::stoi(segmentArray[0]);             //first is vertex
-                if (segmentArray[1] != "")                      //second is uv
-                    uv = std::stoi(segmentArray[1]);
-                else
-                {
-                    qDebug() << "No UVs in mesh!!!";            //uv not present
-                    uv = 0;                                     //this will become -1 in a couple of lines
-                }
-                normal = std::stoi(segmentArray[2]);            //third is normal
+                chunk.ok = readCorner(cursor, end, index, uv, normal);
+                if (!chunk.ok)
+                    break;
 
                 //Fixing the indexes
                 //because obj f-lines starts with 1, not 0
-                --index;
-                --uv;
-                --normal;
+                CornerKey key{ index - 1, uv - 1, normal - 1 };
 
-                if (uv > -1)    //uv present!
-                {
-                    Vertex tempVert(tempVertecies[index], tempNormals[normal], tempUVs[uv]);
-                    mVertices.push_back(tempVert);
-                }
-                else            //no uv in mesh data, use 0, 0 as uv
+                //Same corner seen before in this chunk - just reuse its number
+                auto [corner, isNew] = weldedCorners.try_emplace(key, static_cast<uint32_t>(chunk.uniqueCorners.size()));
+                if (isNew)
+                    chunk.uniqueCorners.push_back(key);
+                chunk.cornerIndices.push_back(corner->second);
+            }
+        }
+        //Comments (#), object names, smoothing groups, blank lines etc. are ignored
+
+        skipLine(cursor, end);
+    }
+}
+
+//Reads the obj file through a memory map, and scans it in place.
+//No std::string or stringstream is made per line, the numbers are converted directly from the file buffer
+bool ObjectMesh::readObjFile(const std::string& filename)
+{
+    std::string tempName = meshPath(filename);
+    qDebug() << "Reading " << tempName.c_str();
+    QFile fileIn(QString::fromStdString(tempName));
+    if (!fileIn.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "ERROR: Could not open file for reading: " << filename.c_str();
+        return false;
+    }
+
+    const qint64 fileSize = fileIn.size();
+    if (fileSize <= 0)
+    {
+        qDebug() << "ERROR: File is empty: " << filename.c_str();
+        return false;
+    }
+    //The whole file as one read only block of memory - the OS pages it in as we scan it
+    uchar* mapped = fileIn.map(0, fileSize);
+    if (mapped == nullptr)
+    {
+        qDebug() << "ERROR: Could not memory map file: " << filename.c_str();
+        return false;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    const char* begin = reinterpret_cast<const char*>(mapped);
+    const char* end = begin + fileSize;
+
+    //Big files are split into one newline aligned chunk per core, small files are read as one chunk
+    size_t chunkCount{ 1 };
+    if (fileSize >= kParallelParseBytes)
+        chunkCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, fileSize / kMinChunkBytes);
+
+    std::vector<const char*> chunkStart(chunkCount + 1, end);
+    chunkStart[0] = begin;
+    for (size_t c = 1; c < chunkCount; c++)
+    {
+        const char* split = std::max(begin + fileSize * c / chunkCount, chunkStart[c - 1]);
+        skipLine(split, end);   //chunks always start at the beginning of a line
+        chunkStart[c] = split;
+    }
+
+    std::vector<ObjChunk> chunks(chunkCount);
+    runParallel(chunkCount, [&](size_t c) { parseObjChunk(chunkStart[c], chunkStart[c + 1], chunks[c]); });
+
+    bool fileOk = std::all_of(chunks.begin(), chunks.end(), [](const ObjChunk& chunk) { return chunk.ok; });
+    if (fileOk)
+        fileOk = mergeObjChunks(chunks);
+
+    fileIn.unmap(mapped);
+    fileIn.close();
+
+    if (!fileOk)
+    {
+        qDebug() << "ERROR: Malformed obj file: " << filename.c_str();
+        mVertices.clear();
+        mIndices.clear();
+        return false;
+    }
+
+    const double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count(), 1e-9);
+    qDebug() << filename.c_str() << " successfully loaded -" << fileSize / (1024.0 * 1024.0) / seconds << "MB/s using" << chunkCount << "thread(s)";
+    qDebug() << "Vertices welded from" << mIndices.size() << "to" << mVertices.size();
+
+    return true;
+}
+
+//Puts the chunks from readObjFile() together into mVertices and mIndices.
+//The result is exactly what reading the file in one go gives:
+//a corner gets its vertex number the first time it is seen in the file, so going through
+//the chunks in file order, and the corners of each chunk in the order they were first seen there, gives the same numbers.
+bool ObjectMesh::mergeObjChunks(std::vector<ObjChunk>& chunks)
+{
+    const size_t chunkCount = chunks.size();
+
+    //Prefix sums - where the data of each chunk goes in the merged arrays
+    std::vector<size_t> positionOffset(chunkCount + 1, 0);
+    std::vector<size_t> normalOffset(chunkCount + 1, 0);
+    std::vector<size_t> uvOffset(chunkCount + 1, 0);
+    std::vector<size_t> cornerOffset(chunkCount + 1, 0);
+    for (size_t c = 0; c < chunkCount; c++)
+    {
+        positionOffset[c + 1] = positionOffset[c] + chunks[c].positions.size();
+        normalOffset[c + 1] = normalOffset[c] + chunks[c].normals.size();
+        uvOffset[c + 1] = uvOffset[c] + chunks[c].uvs.size();
+        cornerOffset[c + 1] = cornerOffset[c] + chunks[c].cornerIndices.size();
+    }
+
+    // temp variables to store the data from the file
+    std::vector<QVector3D> tempVertecies(positionOffset[chunkCount]);
+    std::vector<QVector3D> tempNormals(normalOffset[chunkCount]);
+    std::vector<QVector2D> tempUVs(uvOffset[chunkCount]);
+    runParallel(chunkCount, [&](size_t c) {
+        std::copy(chunks[c].positions.begin(), chunks[c].positions.end(), tempVertecies.begin() + positionOffset[c]);
+        std::copy(chunks[c].normals.begin(), chunks[c].normals.end(), tempNormals.begin() + normalOffset[c]);
+        std::copy(chunks[c].uvs.begin(), chunks[c].uvs.end(), tempUVs.begin() + uvOffset[c]);
+    });
+
+    //Numbering the unique corners of the whole file. One chunk is already numbered correctly
+    std::vector<CornerKey> meshCorners;
+    std::vector<std::vector<uint32_t>> chunkToMesh(chunkCount);
+    if (chunkCount == 1)
+    {
+        meshCorners = std::move(chunks[0].uniqueCorners);
+    }
+    else
+    {
+        size_t uniqueCount{ 0 };
+        for (const ObjChunk& chunk : chunks)
+            uniqueCount += chunk.uniqueCorners.size();
+
+        std::unordered_map<CornerKey, uint32_t, CornerKeyHash> weldedCorners;
+        weldedCorners.reserve(uniqueCount);
+        for (size_t c = 0; c < chunkCount; c++)
+        {
+            chunkToMesh[c].reserve(chunks[c].uniqueCorners.size());
+            for (const CornerKey& key : chunks[c].uniqueCorners)
+            {
+                auto [corner, isNew] = weldedCorners.try_emplace(key, static_cast<uint32_t>(meshCorners.size()));
+                if (isNew)
+                    meshCorners.push_back(key);
+                chunkToMesh[c].push_back(corner->second);
+            }
+        }
+    }
+
+    //Making the vertices - split in equal parts between the threads
+    bool missingUVs{ false };
+    bool indicesOk{ true };
+    std::vector<char> partOk(chunkCount, 1);
+    std::vector<char> partMissingUVs(chunkCount, 0);
+    mVertices.resize(meshCorners.size());
+    runParallel(chunkCount, [&](size_t part) {
+        const size_t first = meshCorners.size() * part / chunkCount;
+        const size_t last = meshCorners.size() * (part + 1) / chunkCount;
+        for (size_t i = first; i < last; i++)
+        {
+            const CornerKey& key = meshCorners[i];
+            if (key.index < 0 || key.index >= static_cast<int>(tempVertecies.size()) ||
+                key.normal >= static_cast<int>(tempNormals.size()) || key.uv >= static_cast<int>(tempUVs.size()))
+            {
+                partOk[part] = 0;
+                return;
+            }
+            QVector3D tempNormal = key.normal > -1 ? tempNormals[key.normal] : QVector3D(0.0f, 0.0f, 0.0f);
+            if (key.uv > -1)    //uv present!
+            {
+                mVertices[i] = Vertex(tempVertecies[key.index], tempNormal, tempUVs[key.uv]);
+            }
+            else                //no uv in mesh data, use 0, 0 as uv
+            {
+                partMissingUVs[part] = 1;
+                mVertices[i] = Vertex(tempVertecies[key.index], tempNormal, QVector2D(0.0f, 0.0f));
+            }
+        }
+    });
+    for (size_t part = 0; part < chunkCount; part++)
+    {
+        indicesOk = indicesOk && partOk[part];
+        missingUVs = missingUVs || partMissingUVs[part];
+    }
+    if (!indicesOk)
+        return false;
+    if (missingUVs)
+        qDebug() << "No UVs in mesh!!!";
+
+    //Indices - each chunk writes its own part, translated from chunk corner numbers to mesh vertex numbers
+    mIndices.resize(cornerOffset[chunkCount]);
+    runParallel(chunkCount, [&](size_t c) {
+        uint32_t* out = mIndices.data() + cornerOffset[c];
+        if (chunkCount == 1)
+            std::copy(chunks[c].cornerIndices.begin(), chunks[c].cornerIndices.end(), out);
+        else
+            for (uint32_t localIndex : chunks[c].cornerIndices)
+                *out++ = chunkToMesh[c][localIndex];
+    });
+
+    return true;
+}
+
+//Reads the binary cache made by writeCacheFile().
+//The file is memory mapped, and decoded straight into mVertices and mIndices.
+//A cache without its obj file is used as it is - that is how meshes are shipped
+bool ObjectMesh::readCacheFile(const std::string& filename)
+{
+    QFileInfo sourceInfo(QString::fromStdString(meshPath(filename)));
+    QFile cacheFile(QString::fromStdString(cachePath(filename)));
+    if (!cacheFile.open(QIODevice::ReadOnly))
+        return false;
+
+    const qint64 fileSize = cacheFile.size();
+    if (fileSize < static_cast<qint64>(sizeof(MeshCacheHeader)))
+        return false;
+    uchar* mapped = cacheFile.map(0, fileSize);
+    if (mapped == nullptr)
+        return false;
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    MeshCacheHeader header;
+    memcpy(&header, mapped, sizeof(header));
+
+    //Check that the cache is made by this version of the program, from the obj file as it is now
+    const bool sourceUnchanged = !sourceInfo.exists() ||
+                                 (header.sourceSize == sourceInfo.size() &&
+                                  header.sourceModified == sourceInfo.lastModified().toMSecsSinceEpoch());
+    bool valid = memcmp(header.magic, "OMSH", 4) == 0 &&
+                 header.version == kMeshCacheVersion &&
+                 header.vertexSize == sizeof(Vertex) &&
+                 sourceUnchanged &&
+                 fileSize == static_cast<qint64>(sizeof(MeshCacheHeader) +
+                                                 header.encodedSize +
+                                                 uint64_t{ header.lodLevelCount } * sizeof(LodLevel));
+    //The header has no checksum, so a damaged count must not decide how much memory is allocated
+    const uchar* encodedData = mapped + sizeof(MeshCacheHeader);
+    const size_t allIndexCount = static_cast<size_t>(header.indexCount) + header.lodIndexCount;
+    valid = valid && MeshCodec::canHold(encodedData, header.encodedSize, header.vertexCount, allIndexCount);
+    if (valid)
+    {
+        const uchar* lodLevelData = encodedData + header.encodedSize;
+        mVertices.resize(header.vertexCount);
+        mIndices.resize(allIndexCount);
+        valid = MeshCodec::decode(encodedData, header.encodedSize, mVertices, mIndices);
+
+        mLodIndices.assign(mIndices.begin() + header.indexCount, mIndices.end());
+        mIndices.resize(header.indexCount);
+        mLodLevels.resize(header.lodLevelCount);
+        memcpy(mLodLevels.data(), lodLevelData, header.lodLevelCount * sizeof(LodLevel));
+
+        //The levels of detail count from the start of mIndices, and must stay inside mIndices and mLodIndices
+        for (const LodLevel& level : mLodLevels)
+            valid = valid && uint64_t{ level.firstIndex } + level.indexCount <= allIndexCount;
+    }
+    cacheFile.unmap(mapped);
+
+    if (!valid)
+    {
+        qDebug() << "Mesh cache for" << filename.c_str() << "is outdated or damaged";
+        mVertices.clear();
+        mIndices.clear();
+        mLodIndices.clear();
+        mLodLevels.clear();
+        return false;
+    }
+
+    mBoundsMin = QVector3D(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    mBoundsMax = QVector3D(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+
+    const double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count(), 1e-9);
+    qDebug() << filename.c_str() << "loaded from mesh cache -" << mVertices.size() << "vertices," << mIndices.size() << "indices,"
+             << fileSize / (1024.0 * 1024.0) / seconds << "MB/s";
+    return true;
+}
+
+//Writes the parsed mesh to <filename>.meshcache, compressed with MeshCodec.
+//QSaveFile writes to a temporary file first, so a crash never leaves a half written cache behind
+bool ObjectMesh::writeCacheFile(const std::string& filename) const
+{
+    QFileInfo sourceInfo(QString::fromStdString(meshPath(filename)));
+
+    //One index stream: the full mesh, then the levels of detail
+    std::vector<uint32_t> allIndices;
+    allIndices.reserve(mIndices.size() + mLodIndices.size());
+    allIndices.insert(allIndices.end(), mIndices.begin(), mIndices.end());
+    allIndices.insert(allIndices.end(), mLodIndices.begin(), mLodIndices.end());
+    const QByteArray encoded = MeshCodec::encode(mVertices, allIndices);
+
+    MeshCacheHeader header{};
+    memcpy(header.magic, "OMSH", 4);
+    header.version = kMeshCacheVersion;
+    header.vertexSize = sizeof(Vertex);
+    header.vertexCount = static_cast<uint32_t>(mVertices.size());
+    header.indexCount = static_cast<uint32_t>(mIndices.size());
+    header.lodLevelCount = static_cast<uint32_t>(mLodLevels.size());
+    header.lodIndexCount = static_cast<uint32_t>(mLodIndices.size());
+    header.encodedSize = static_cast<uint32_t>(encoded.size());
+    header.sourceSize = sourceInfo.size();
+    header.sourceModified = sourceInfo.lastModified().toMSecsSinceEpoch();
+    for (int i = 0; i < 3; i++)
+    {
+        header.boundsMin[i] = mBoundsMin[i];
+        header.boundsMax[i] = mBoundsMax[i];
+    }
+
+    QSaveFile cacheFile(QString::fromStdString(cachePath(filename)));
+    if (!cacheFile.open(QIODevice::WriteOnly))
+        return false;
+    cacheFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    cacheFile.write(encoded.constData(), encoded.size());
+    cacheFile.write(reinterpret_cast<const char*>(mLodLevels.data()), mLodLevels.size() * sizeof(LodLevel));
+    if (!cacheFile.commit())
+        return false;
+
+    qDebug() << "Mesh cache for" << filename.c_str() << "written -" << encoded.size() << "bytes encoded from"
+             << mVertices.size() * sizeof(Vertex) + allIndices.size() * sizeof(uint32_t);
+    return true;
+}
+
+//Axis aligned bounding box of the mesh in its own coordinate system
+void ObjectMesh::calculateBounds()
+{
+    if (mVertices.empty())
+        return;
+
+    mBoundsMin = mBoundsMax = QVector3D(mVertices[0].x, mVertices[0].y, mVertices[0].z);
+    for (const Vertex& vertex : mVertices)
+    {
+        mBoundsMin = QVector3D(std::min(mBoundsMin.x(), vertex.x), std::min(mBoundsMin.y(), vertex.y), std::min(mBoundsMin.z(), vertex.z));
+        mBoundsMax = QVector3D(std::max(mBoundsMax.x(), vertex.x), std::max(mBoundsMax.y(), vertex.y), std::max(mBoundsMax.z(), vertex.z));
+    }
+}
+
+//Two passes over the memory mapped file:
+//the first one only notes where the v/vt/vn lines are and counts the face corners,
+//the second one makes the vertices and indices straight into the chunks of the sink.
+//A face that does not fit in the current chunk starts a new one, and vertices are only welded within a chunk -
+//the weld table is cleared with each chunk, so it never grows past kChunkVertexCount
+bool ObjectMesh::streamObjFile(const std::string& filename, ObjStreamSink& sink)
+{
+    std::string tempName = meshPath(filename);
+    qDebug() << "Streaming " << tempName.c_str();
+    QFile fileIn(QString::fromStdString(tempName));
+    if (!fileIn.open(QIODevice::ReadOnly) || fileIn.size() <= 0)
+    {
+        qDebug() << "ERROR: Could not open file for reading: " << filename.c_str();
+        sink.end(false);
+        return false;
+    }
+    const qint64 fileSize = fileIn.size();
+    uchar* mapped = fileIn.map(0, fileSize);
+    if (mapped == nullptr)
+    {
+        qDebug() << "ERROR: Could not memory map file: " << filename.c_str();
+        sink.end(false);
+        return false;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    const char* begin = reinterpret_cast<const char*>(mapped);
+    const char* end = begin + fileSize;
+
+    ObjRecordTable<3> positions("v", begin, end);
+    ObjRecordTable<2> uvs("vt", begin, end);
+    ObjRecordTable<3> normals("vn", begin, end);
+    size_t cornerCount{ 0 };
+
+    //First pass - where are the lines
+    for (const char* cursor = begin; cursor < end; skipLine(cursor, end))
+    {
+        skipBlanks(cursor, end);
+        const char* word = cursor;
+        while (cursor < end && !isBlank(*cursor) && *cursor != '\n')
+            ++cursor;
+        const size_t wordLength = cursor - word;
+
+        if (wordLength == 1 && word[0] == 'v')
+            positions.addRecord(word);
+        else if (wordLength == 2 && word[0] == 'v' && word[1] == 't')
+            uvs.addRecord(word);
+        else if (wordLength == 2 && word[0] == 'v' && word[1] == 'n')
+            normals.addRecord(word);
+        else if (wordLength == 1 && word[0] == 'f')
+            cornerCount += 3;
+    }
+
+    bool fileOk = cornerCount > 0 && cornerCount <= UINT32_MAX;
+    if (fileOk)
+        sink.begin(cornerCount, cornerCount);
+
+    //Second pass - the faces
+    Vertex* chunkVertices{ nullptr };
+    uint32_t* chunkIndices{ nullptr };
+    size_t vertexCount{ 0 }, indexCount{ 0 };  //in the current chunk
+    size_t vertexBase{ 0 };                     //vertices in the chunks before
+    bool missingUVs{ false };
+    std::unordered_map<CornerKey, uint32_t, CornerKeyHash> weldedCorners;
+    weldedCorners.reserve(ObjStreamSink::kChunkVertexCount);
+    if (fileOk)
+        sink.nextChunk(chunkVertices, chunkIndices);
+
+    for (const char* cursor = begin; fileOk && cursor < end; skipLine(cursor, end))
+    {
+        skipBlanks(cursor, end);
+        if (cursor + 1 >= end || cursor[0] != 'f' || !isBlank(cursor[1]))
+            continue;
+        ++cursor;
+
+        //Room for a whole triangle, or start a new chunk
+        if (vertexCount + 3 > ObjStreamSink::kChunkVertexCount || indexCount + 3 > ObjStreamSink::kChunkIndexCount)
+        {
+            sink.chunkFilled(vertexCount, indexCount);
+            vertexBase += vertexCount;
+            vertexCount = indexCount = 0;
+            weldedCorners.clear();
+            sink.nextChunk(chunkVertices, chunkIndices);
+        }
+
+        int index, normal, uv;
+        for (int i = 0; i < 3 && fileOk; i++)
+        {
+            fileOk = readCorner(cursor, end, index, uv, normal);
+            if (!fileOk)
+                break;
+
+            //obj f-lines starts with 1, not 0
+            CornerKey key{ index - 1, uv - 1, normal - 1 };
+            auto [corner, isNew] = weldedCorners.try_emplace(key, static_cast<uint32_t>(vertexCount));
+            if (isNew)
+            {
+                const float* position = key.index >= 0 && static_cast<size_t>(key.index) < positions.size() ? positions.get(key.index) : nullptr;
+                const float* texcoord = key.uv >= 0 && static_cast<size_t>(key.uv) < uvs.size() ? uvs.get(key.uv) : nullptr;
+                const float* direction = key.normal >= 0 && static_cast<size_t>(key.normal) < normals.size() ? normals.get(key.normal) : nullptr;
+                if (position == nullptr || (key.uv >= 0 && texcoord == nullptr) || (key.normal >= 0 && direction == nullptr))
                 {
-                    Vertex tempVert(tempVertecies[index], tempNormals[normal], QVector2D(0.0f, 0.0f));
-                    mVertices.push_back(tempVert);
+                    fileOk = false;
+                    break;
                 }
-                //We have now handeled one Vertex on the f-line - add it to indices
-                mIndices.push_back(temp_index++);
+                missingUVs = missingUVs || texcoord == nullptr;
+
+                chunkVertices[vertexCount++] = Vertex{ position[0], position[1], position[2],
+                                                       direction ? direction[0] : 0.f, direction ? direction[1] : 0.f, direction ? direction[2] : 0.f,
+                                                       texcoord ? texcoord[0] : 0.f, texcoord ? texcoord[1] : 0.f };
             }
-            continue;
+            chunkIndices[indexCount++] = static_cast<uint32_t>(vertexBase + corner->second);
         }
     }
-    // beeing a nice boy and closing the file after use
+
+    if (fileOk && indexCount > 0)
+        sink.chunkFilled(vertexCount, indexCount);
+    sink.end(fileOk);
+
+    fileIn.unmap(mapped);
     fileIn.close();
 
-    qDebug() << filename.c_str() << " successfully loaded";
+    if (!fileOk)
+    {
+        qDebug() << "ERROR: Malformed obj file: " << filename.c_str();
+        return false;
+    }
+    if (missingUVs)
+        qDebug() << "No UVs in mesh!!!";
 
+    const double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count(), 1e-9);
+    qDebug() << filename.c_str() << " successfully streamed -" << fileSize / (1024.0 * 1024.0) / seconds << "MB/s,"
+             << vertexBase + vertexCount << "vertices," << cornerCount << "indices";
     return true;
 }
@@ -3,18 +3,60 @@
 
 #include "VisualObject.h"
 #include <string>
-#include <fstream>
-#include <iostream>
-#include <sstream>
 #include <QDebug>
 #include <QVector3D>
 #include "Vertex.h"
+
+//Receives the mesh from ObjectMesh::streamObjFile() one fixed size chunk at a time.
+//The functions are called on the thread that streams the file
+class ObjStreamSink
+{
+public:
+    virtual ~ObjStreamSink() = default;
+
+    //Called once before the first chunk: the most vertices the mesh can get (one per face corner), and the number of indices
+    virtual void begin(size_t maxVertexCount, size_t indexCount) = 0;
+    //Memory to write the next chunk into - room for kChunkVertexCount vertices and kChunkIndexCount indices.
+    //Can wait until memory from an earlier chunk is free again
+    virtual void nextChunk(Vertex*& vertices, uint32_t*& indices) = 0;
+    //The chunk from nextChunk() is filled. The vertices go right after the ones in earlier chunks, same with the indices
+    virtual void chunkFilled(size_t vertexCount, size_t indexCount) = 0;
+    //Called last, also when the file could not be read
+    virtual void end(bool ok) = 0;
+
+    static constexpr size_t kChunkVertexCount{ 64 * 1024 };            //2 MB of vertices
+    static constexpr size_t kChunkIndexCount{ 3 * kChunkVertexCount };  //768 kB of indices
+};
+
 class ObjectMesh : public VisualObject
 {
 public:
     ObjectMesh(const std::string& filename);
+
+    inline QVector3D getBoundsMin() const { return mBoundsMin; }
+    inline QVector3D getBoundsMax() const { return mBoundsMax; }
+
+    //Reads an obj file too big to hold in memory, and hands it to sink in fixed size chunks.
+    //Memory use does not grow with the mesh - only with the number of v/vt/vn lines, and by 1/4 byte per line.
+    //Vertices are welded within each chunk only, so the mesh gets some more vertices than readObjFile() makes
+    static bool streamObjFile(const std::string& filename, ObjStreamSink& sink);
+
 private:
     bool readObjFile(const std::string& filename);
+
+    //Everything read from one newline aligned part of an obj file - defined in objectmesh.cpp
+    struct ObjChunk;
+    static void parseObjChunk(const char* cursor, const char* end, ObjChunk& chunk);
+    bool mergeObjChunks(std::vector<ObjChunk>& chunks);
+
+    //Compressed binary cache of the parsed mesh, stored next to the obj file as <filename>.meshcache (see MeshCodec.h)
+    //The cache is rebuilt when the obj file changes size or modification time. Without the obj file it is used as it is
+    bool readCacheFile(const std::string& filename);
+    bool writeCacheFile(const std::string& filename) const;
+    void calculateBounds();
+
+    QVector3D mBoundsMin{};
+    QVector3D mBoundsMax{};
 };
 
 #endif // OBJECTMESH_H
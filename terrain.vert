@@ -0,0 +1,88 @@
+#version 450
+
+//The displaced terrain, see HeightMap::makeDisplacedTerrain().
+//One flat patch of kChunkQuads x kChunkQuads quads is drawn for each level of detail node from HeightMap::selectLod(),
+//with nodeStride samples between its vertices, and each vertex gets its height and normal from the height texture
+const int kChunkQuads = 64;     //HeightMap::kChunkQuads
+
+layout(location = 0) in vec2 patchPosition;     //vertex in the patch, 0 to kChunkQuads
+
+layout(location = 0) out vec3 vColor;
+layout(location = 1) out vec2 vUV;
+
+
+layout(push_constant) uniform mod {
+    mat4 model;
+    float originX;          //x and z of the first sample - x grows with w, z shrinks with d
+    float originZ;
+    float spacing;          //meters between the samples
+    float heightScale;      //height = texture value (0 to 1) * heightScale + heightOffset
+    float heightOffset;
+    int gridWidth;          //samples along x
+    int gridDepth;          //samples along z
+    float cameraX;          //camera in the coordinates of the terrain
+    float cameraY;
+    float cameraZ;
+    //The node being drawn
+    int nodeStartW;
+    int nodeStartD;
+    int nodeStride;         //1 << level
+    float morphStart;       //distance where the vertices start to move onto the next level
+    float morphEnd;         //and where they are there
+} model;
+
+layout(set = 0, binding = 0) uniform cam {
+    mat4 view;
+    mat4 projection;
+} camera;
+
+layout(set = 2, binding = 0) uniform sampler2D heightSampler;
+
+out gl_PerVertex { vec4 gl_Position; };
+
+float heightAt(ivec2 sampleIndex)
+{
+    return texelFetch(heightSampler, sampleIndex, 0).r * model.heightScale + model.heightOffset;
+}
+
+vec3 positionAt(vec2 sampleIndex, float height)
+{
+    return vec3(model.originX + sampleIndex.x * model.spacing, height, model.originZ - sampleIndex.y * model.spacing);
+}
+
+void main()
+{
+    const ivec2 lastSample = ivec2(model.gridWidth - 1, model.gridDepth - 1);
+    const ivec2 patchIndex = ivec2(patchPosition);
+    //Nodes on the far edges can be bigger than the grid - the vertices past the edge are put on it
+    const ivec2 sampleIndex = min(ivec2(model.nodeStartW, model.nodeStartD) + patchIndex * model.nodeStride, lastSample);
+    const float height = heightAt(sampleIndex);
+
+    //Morphing: the odd vertices of the patch are not in the next level. Their height slides to the edge between
+    //the even vertices next to them - along the edge they are on, or the diagonal for those in the middle of a quad
+    //(the same diagonal as HeightMap::makeTerrain()). At morph 1 the surface is exactly the next level.
+    //The vertices on the grid edge stay, as they are vertices of all levels
+    const ivec2 odd = (patchIndex & 1) * ivec2(notEqual(sampleIndex, lastSample));
+    const ivec2 before = sampleIndex - odd * model.nodeStride;
+    const ivec2 after = min(sampleIndex + odd * model.nodeStride, lastSample);
+    const float along = odd.x != 0 ? float(sampleIndex.x - before.x) / float(after.x - before.x)
+                                   : float(sampleIndex.y - before.y) / float(max(after.y - before.y, 1));
+    const float nextLevelHeight = mix(heightAt(before), heightAt(after), along);
+
+    const vec3 cameraPosition = vec3(model.cameraX, model.cameraY, model.cameraZ);
+    const float morph = clamp((distance(positionAt(vec2(sampleIndex), height), cameraPosition) - model.morphStart)
+                              / (model.morphEnd - model.morphStart), 0.0, 1.0);
+
+    //Normal from central differences of this level, one sided on the edges - like HeightMap::calculateHeighMapNormals()
+    const ivec2 left = max(sampleIndex - ivec2(model.nodeStride, 0), ivec2(0));
+    const ivec2 right = min(sampleIndex + ivec2(model.nodeStride, 0), lastSample);
+    const ivec2 up = max(sampleIndex - ivec2(0, model.nodeStride), ivec2(0));
+    const ivec2 down = min(sampleIndex + ivec2(0, model.nodeStride), lastSample);
+    const vec3 normal = vec3((heightAt(left) - heightAt(right)) * 2.0 / float(right.x - left.x),
+                             2.0 * model.spacing,
+                             (heightAt(down) - heightAt(up)) * 2.0 / float(down.y - up.y));
+
+    vColor = normalize(normal);
+    vUV = vec2(sampleIndex) / vec2(lastSample);
+    gl_Position = camera.projection * camera.view * model.model * vec4(positionAt(vec2(sampleIndex), mix(height, nextLevelHeight, morph)), 1.0);
+}
@@ -0,0 +1,42 @@
+#version 450
+
+//The terrain mesh of HeightMap::makeTerrain(), with the 4 byte TerrainVertex.
+//The vertices are in row-major grid order, so x and z come from the vertex index
+layout(location = 0) in uint height;        //the sample
+layout(location = 1) in vec2 normalXZ;      //x and z of the unit normal
+
+layout(location = 0) out vec3 vColor;
+layout(location = 1) out vec2 vUV;
+
+
+//The same as in terrain.vert - only the terrain parameters are used here
+layout(push_constant) uniform mod {
+    mat4 model;
+    float originX;          //x and z of the first sample - x grows with w, z shrinks with d
+    float originZ;
+    float spacing;          //meters between the samples
+    float heightScale;      //height = sample * heightScale + heightOffset
+    float heightOffset;
+    int gridWidth;          //samples along x
+    int gridDepth;          //samples along z
+} model;
+
+layout(set = 0, binding = 0) uniform cam {
+    mat4 view;
+    mat4 projection;
+} camera;
+
+out gl_PerVertex { vec4 gl_Position; };
+
+void main()
+{
+    const ivec2 sampleIndex = ivec2(gl_VertexIndex % model.gridWidth, gl_VertexIndex / model.gridWidth);
+    const vec3 position = vec3(model.originX + sampleIndex.x * model.spacing,
+                               float(height) * model.heightScale + model.heightOffset,
+                               model.originZ - sampleIndex.y * model.spacing);
+
+    //The normal always points up, so y is the positive root
+    vColor = vec3(normalXZ.x, sqrt(max(1.0 - dot(normalXZ, normalXZ), 0.0)), normalXZ.y);
+    vUV = vec2(sampleIndex) / vec2(model.gridWidth - 1, model.gridDepth - 1);
+    gl_Position = camera.projection * camera.view * model.model * vec4(position, 1.0);
+}
@@ -56,7 +56,6 @@ wall::wall(float r, float g, float b, float u, float v) {
 
     //Skalerer ned kvadrat i eget kordinatsystem/frame
     //Temporary scale and positioning
-    mMatrix.setToIdentity();
-    mMatrix.scale(0.5f);
-    mMatrix.translate(0.5f, 0.1f, 0.1f);
+    scale(0.5f);
+    move(0.5f, 0.1f, 0.1f);
 }